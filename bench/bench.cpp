@@ -0,0 +1,346 @@
+#include "icemet/hologram.hpp"
+#include "icemet/img.hpp"
+#include "icemet/util/strfmt.hpp"
+#include "icemet/util/time.hpp"
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static const char* usageStr = "Usage: icemet-bench [options] [benchmark...]\n";
+static const char* helpStr =
+"Options:\n"
+"  -h                Print this help message and exit.\n"
+"  -c                Use the CPU backend.\n"
+"  -W width          Image width. Default 1024.\n"
+"  -H height         Image height. Default 1024.\n"
+"  -n planes         Number of planes per iteration. Default 64.\n"
+"  -i iterations     Number of iterations. Default 10.\n"
+"  -b batch          Reconstruction batch size. Default 1.\n"
+"  -f file           Reference hologram for the accuracy benchmarks. Can be given multiple times.\n"
+"\n"
+"Benchmarks:\n"
+"  segment           Amplitude and phase reconstruction throughput.\n"
+"  kernels           Hologram kernel variants (OpenCL only).\n"
+"  fp16              Accuracy and throughput of the half precision storage against fp32 (OpenCL only).\n"
+"  bgsub             Background median of every stack length, sorted stack and sorting network.\n";
+
+typedef struct _bench_param {
+	cv::Size2i size;
+	int planes;
+	int iters;
+	int batch;
+	std::vector<std::string> files;
+} BenchParam;
+
+typedef struct _bench {
+	const char* name;
+	std::function<void(const BenchParam&)> func;
+} Bench;
+
+template <typename... Args>
+static void print(const std::string& fmt, Args... args)
+{
+	std::cout << strfmt(fmt, args...);
+}
+
+static void sync()
+{
+	if (cv::ocl::useOpenCL())
+		cv::ocl::finish();
+}
+
+static cv::UMat testImage(const cv::Size2i& size)
+{
+	// Random speckle around the typical background level
+	cv::Mat img(size, CV_8UC1);
+	cv::randn(img, 128, 16);
+	return img.getUMat(cv::ACCESS_READ).clone();
+}
+
+static cv::UMat particleImage(const cv::Size2i& size, const ZRange& range)
+{
+	// Opaque discs at random positions and depths. The scattered fields are summed
+	// with the background phase removed and the intensity is recorded.
+	cv::RNG rng(0x1ce);
+	Hologram hologram(3.45e-6, 660e-9);
+	cv::Mat field(size, CV_32FC2, cv::Scalar(1.0, 0.0));
+	for (int k = 0; k < 16; k++) {
+		cv::Mat obj(size, CV_32FC1, cv::Scalar(1.0));
+		cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		cv::circle(obj, center, rng.uniform(3, 30), cv::Scalar(0.0), cv::FILLED);
+		hologram.setImg(obj.getUMat(cv::ACCESS_READ));
+		cv::UMat dst;
+		hologram.recon(dst, range.z(rng.uniform(0, range.n())), RECON_OUTPUT_COMPLEX);
+		cv::Mat E = dst.getMat(cv::ACCESS_READ).clone();
+		cv::Scalar bg = cv::mean(E);
+		double a = std::hypot(bg[0], bg[1]);
+		cv::Vec2f c(bg[0]/a, -bg[1]/a);
+		E.forEach<cv::Vec2f>([&](cv::Vec2f& v, const int*) {
+			v = cv::Vec2f(v[0]*c[0] - v[1]*c[1], v[0]*c[1] + v[1]*c[0]) - cv::Vec2f(1.0, 0.0);
+		});
+		field += E;
+	}
+	cv::Mat img(size, CV_8UC1);
+	field.forEach<cv::Vec2f>([&](cv::Vec2f& v, const int* pos) {
+		img.at<uchar>(pos[0], pos[1]) = cv::saturate_cast<uchar>(128 * (v[0]*v[0] + v[1]*v[1]));
+	});
+	return img.getUMat(cv::ACCESS_READ).clone();
+}
+
+static double measure(int iters, const std::function<void()>& f)
+{
+	// The first round builds the kernels and allocates buffers
+	f();
+	sync();
+	Measure m;
+	for (int i = 0; i < iters; i++)
+		f();
+	sync();
+	return m.time() / iters;
+}
+
+static void benchSegment(const BenchParam& param)
+{
+	HologramPtr hologram = cv::makePtr<Hologram>(3.45e-6, 660e-9);
+	hologram->setBatch(param.batch);
+	hologram->setImg(testImage(param.size));
+	float dz = (0.1 - 0.02) / param.planes;
+	ZRange range(0.02, 0.1, dz, dz);
+	
+	std::vector<cv::UMat> stack;
+	cv::UMat imgMin;
+	for (ReconOutput output : {RECON_OUTPUT_AMPLITUDE, RECON_OUTPUT_PHASE}) {
+		const char* name = output == RECON_OUTPUT_AMPLITUDE ? "amplitude" : "phase";
+		double t = measure(param.iters, [&]() {
+			imgMin = cv::UMat(param.size, CV_8UC1, cv::Scalar(255));
+			hologram->reconMin(stack, imgMin, range, output);
+		});
+		print("segment {:>10} reconMin {:8.2f} ms {:8.1f} planes/s\n", name, 1000*t, range.n() / t);
+		t = measure(param.iters, [&]() {
+			imgMin = cv::UMat(param.size, CV_8UC1, cv::Scalar(255));
+			hologram->min(imgMin, range, output);
+		});
+		print("segment {:>10} min      {:8.2f} ms {:8.1f} planes/s\n", name, 1000*t, range.n() / t);
+	}
+}
+
+static void benchKernels(const BenchParam& param)
+{
+	if (!cv::ocl::useOpenCL()) {
+		print("kernels requires OpenCL\n");
+		return;
+	}
+	HologramPtr hologram = cv::makePtr<Hologram>(3.45e-6, 660e-9);
+	hologram->setImg(testImage(param.size));
+	float dz = (0.1 - 0.02) / param.planes;
+	ZRange range(0.02, 0.1, dz, dz);
+	
+	// Segments spread over the image
+	std::vector<cv::Rect> rects;
+	std::vector<FocusMethod> methods;
+	for (int y = 64; y+64 <= param.size.height; y += 256) {
+		for (int x = 64; x+64 <= param.size.width; x += 256) {
+			rects.emplace_back(x, y, 64, 64);
+			methods.push_back(FOCUS_STD);
+		}
+	}
+	
+	std::string optsDefault = Hologram::kernelOptions();
+	std::vector<cv::UMat> stack;
+	cv::UMat imgMin;
+	for (const char* opts : {"", "-D PIXEL_VEC4", "-D FOCUS_TILED", "-D PIXEL_VEC4 -D FOCUS_TILED"}) {
+		Hologram::setKernelOptions(opts);
+		std::string name = *opts ? opts : "(none)";
+		double t = measure(param.iters, [&]() {
+			imgMin = cv::UMat(param.size, CV_8UC1, cv::Scalar(255));
+			hologram->reconMin(stack, imgMin, range, RECON_OUTPUT_AMPLITUDE);
+		});
+		print("kernels {:<28} reconMin {:8.2f} ms {:8.1f} planes/s\n", name, 1000*t, range.n() / t);
+		std::vector<int> idx;
+		std::vector<double> score;
+		t = measure(param.iters, [&]() {
+			Hologram::focus(stack, rects, methods, idx, score);
+		});
+		print("kernels {:<28} focus    {:8.2f} ms {:8.1f} segments/s\n", name, 1000*t, rects.size() / t);
+	}
+	Hologram::setKernelOptions(optsDefault);
+}
+
+static void benchFp16(const BenchParam& param)
+{
+	if (!cv::ocl::useOpenCL()) {
+		print("fp16 requires OpenCL\n");
+		return;
+	}
+	float dz = (0.1 - 0.02) / param.planes;
+	ZRange range(0.02, 0.1, dz, dz);
+	
+	std::vector<std::pair<std::string,cv::UMat>> images;
+	for (const auto& fn : param.files) {
+		cv::Mat img = cv::imread(fn, cv::IMREAD_GRAYSCALE);
+		if (img.empty()) {
+			print("Couldn't read '{}'\n", fn);
+			continue;
+		}
+		images.emplace_back(fn, img.getUMat(cv::ACCESS_READ).clone());
+	}
+	if (images.empty()) {
+		images.emplace_back("particles", particleImage(param.size, range));
+		images.emplace_back("speckle", testImage(param.size));
+	}
+	
+	for (const auto& image : images) {
+		for (bool cached : {false, true}) {
+			HologramPtr holograms[2];
+			for (int i = 0; i < 2; i++) {
+				holograms[i] = cv::makePtr<Hologram>(3.45e-6, 660e-9);
+				holograms[i]->setFp16Storage(i == 1);
+				holograms[i]->setBatch(param.batch);
+				holograms[i]->setImg(image.second);
+				if (cached)
+					holograms[i]->setCache(range, (size_t)1 << 40);
+			}
+			const char* name = cached ? "cached" : "uncached";
+			
+			// Relative RMS error of the complex field, worst plane of a few
+			double fieldErr = 0.0;
+			for (int i = 0; i < range.n(); i += std::max(1, range.n()/8)) {
+				cv::UMat E32, E16;
+				holograms[0]->recon(E32, range.z(i), RECON_OUTPUT_COMPLEX);
+				holograms[1]->recon(E16, range.z(i), RECON_OUTPUT_COMPLEX);
+				fieldErr = std::max(fieldErr, cv::norm(E32, E16, cv::NORM_L2) / cv::norm(E32, cv::NORM_L2));
+			}
+			
+			// 8-bit amplitude planes and minimum images as used by the segmentation
+			std::vector<cv::UMat> stacks[2];
+			cv::UMat imgMin[2];
+			double t[2];
+			for (int i = 0; i < 2; i++) {
+				t[i] = measure(param.iters, [&]() {
+					imgMin[i] = cv::UMat(image.second.size(), CV_8UC1, cv::Scalar(255));
+					holograms[i]->reconMin(stacks[i], imgMin[i], range, RECON_OUTPUT_AMPLITUDE);
+				});
+			}
+			double ampMax = 0.0;
+			size_t ampDiff = 0;
+			for (int i = 0; i < range.n(); i++) {
+				cv::UMat diff;
+				cv::absdiff(stacks[0][i], stacks[1][i], diff);
+				ampMax = std::max(ampMax, cv::norm(diff, cv::NORM_INF));
+				ampDiff += cv::countNonZero(diff);
+			}
+			double minMax = cv::norm(imgMin[0], imgMin[1], cv::NORM_INF);
+			double ampFrac = (double)ampDiff / ((double)range.n() * image.second.total());
+			
+			print("fp16 {:<12} {:<8} field rms {:.2e} amplitude max {:3.0f} differ {:6.3f} % min max {:3.0f}\n", image.first, name, fieldErr, ampMax, 100*ampFrac, minMax);
+			print("fp16 {:<12} {:<8} reconMin fp32 {:8.2f} ms fp16 {:8.2f} ms speedup {:.2f}\n", image.first, name, 1000*t[0], 1000*t[1], t[0] / t[1]);
+		}
+	}
+}
+
+static void benchBGSub(const BenchParam& param)
+{
+	std::vector<ImgPtr> images;
+	for (int i = 0; i < 25; i++) {
+		images.push_back(cv::makePtr<Image>());
+		images.back()->preproc = testImage(param.size);
+	}
+	
+	for (int len = 3; len <= 25; len += 2) {
+		double t[2];
+		for (bool network : {false, true}) {
+			BGSubStack stack(len, network);
+			for (int i = 0; i < len; i++)
+				stack.push(images[i]);
+			
+			// One frame is a push and a division. push() leaves the preprocessed image as a view
+			// of its stack slot, so every frame gets a fresh image instead of writing to a slot.
+			int i = 0;
+			t[network] = measure(param.iters, [&]() {
+				ImgPtr img = images[i++ % images.size()];
+				img->preproc = testImage(param.size);
+				stack.push(img);
+				stack.meddiv();
+			});
+		}
+		print("bgsub len {:2} sorted {:8.2f} ms network {:8.2f} ms\n", len, 1000*t[0], 1000*t[1]);
+	}
+}
+
+static const Bench benchmarks[] {
+	{"segment", benchSegment},
+	{"kernels", benchKernels},
+	{"fp16", benchFp16},
+	{"bgsub", benchBGSub}
+};
+
+int main(int argc, char* argv[])
+{
+	BenchParam param{cv::Size2i(1024, 1024), 64, 10, 1, {}};
+	bool cpu = false;
+	std::vector<std::string> names;
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		bool hasVal = i+1 < argc;
+		if (!arg.compare("-h")) {
+			print("{}\n{}", usageStr, helpStr);
+			return EXIT_SUCCESS;
+		}
+		else if (!arg.compare("-c")) {
+			cpu = true;
+		}
+		else if (!arg.compare("-W") && hasVal) {
+			param.size.width = std::atoi(argv[++i]);
+		}
+		else if (!arg.compare("-H") && hasVal) {
+			param.size.height = std::atoi(argv[++i]);
+		}
+		else if (!arg.compare("-n") && hasVal) {
+			param.planes = std::atoi(argv[++i]);
+		}
+		else if (!arg.compare("-i") && hasVal) {
+			param.iters = std::atoi(argv[++i]);
+		}
+		else if (!arg.compare("-b") && hasVal) {
+			param.batch = std::atoi(argv[++i]);
+		}
+		else if (!arg.compare("-f") && hasVal) {
+			param.files.push_back(argv[++i]);
+		}
+		else if (arg[0] == '-') {
+			print("Invalid option '{}'\n", arg);
+			return EXIT_FAILURE;
+		}
+		else {
+			names.push_back(arg);
+		}
+	}
+	
+	if (cpu)
+		cv::ocl::setUseOpenCL(false);
+	if (cv::ocl::useOpenCL())
+		print("OpenCL device {}\n", cv::ocl::Device::getDefault().name());
+	else
+		print("CPU backend ({} threads)\n", cv::getNumThreads());
+	print("{}x{}, {} planes, {} iterations, batch {}\n", param.size.width, param.size.height, param.planes, param.iters, param.batch);
+	
+	for (const auto& bench : benchmarks) {
+		bool run = names.empty();
+		for (const auto& name : names)
+			run |= !name.compare(bench.name);
+		if (run)
+			bench.func(param);
+	}
+	return EXIT_SUCCESS;
+}
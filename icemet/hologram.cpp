@@ -1,19 +1,47 @@
 #include "hologram.hpp"
 
+#include "icemet/util/mem.hpp"
+#include "icemet/util/ocl.hpp"
 #include "opencl/icemet_hologram_ocl.hpp"
 
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/utility.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 #include <map>
+#include <mutex>
 
 #define FILTER_N 6
 #define FILTER_F 0.5
 
+#define BATCH_MAX 32
+#define BATCH_MEM_DIV 8
+#define STEP_MEM_DIV 2
+
+#define TILE 16 // Must match icemet_hologram.cl
+#define FOCUS_LOCAL 64 // Must match icemet_hologram.cl
+#define FOCUS_GROUPS 32
+
+#define PI 3.141592653589793f
+
+typedef enum _focus_filter {
+	FOCUS_FILTER_NONE = 0,
+	FOCUS_FILTER_STD,
+	FOCUS_FILTER_GRAD
+} FocusFilter;
+
+typedef struct _focus_stats {
+	double min, max, sum, sqsum;
+	int n;
+} FocusStats;
+
 typedef struct _focus_param {
-	int type; // OpenCV type
+	FocusFilter filter;
 	ReconOutput output;
-	std::function<double(const cv::UMat&)> scoreFunc;
+	std::function<double(const FocusStats&)> scoreFunc;
 } FocusParam;
 
 ZRange::ZRange(float z0, float z1, float dz0, float dz1)
@@ -37,6 +65,24 @@ void ZRange::setParam(float z0, float z1, float dz0, float dz1)
 	}
 }
 
+ZRange ZRange::slice(int i0, int i1) const
+{
+	ZRange range;
+	range.m_z.assign(m_z.begin()+i0, m_z.begin()+i1);
+	range.m_dz.assign(m_dz.begin()+i0, m_dz.begin()+i1);
+	return range;
+}
+
+ZRange ZRange::sample(int step) const
+{
+	ZRange range;
+	for (size_t i = 0; i < m_z.size(); i += step) {
+		range.m_z.push_back(m_z[i]);
+		range.m_dz.push_back(m_dz[i] * step);
+	}
+	return range;
+}
+
 int ZRange::n() const
 {
 	return m_z.size();
@@ -47,75 +93,1034 @@ float ZRange::z(int i) const
 	return m_z[i];
 }
 
+float ZRange::interp(double i) const
+{
+	if (m_z.size() < 2)
+		return m_z[0];
+	int i0 = std::max(0, std::min((int)m_z.size()-2, (int)std::floor(i)));
+	return m_z[i0] + (i - i0) * (m_z[i0+1] - m_z[i0]);
+}
+
 float ZRange::dz(int i) const
 {
 	return m_dz[i];
 }
 
-double scoreMin(const cv::UMat& slice)
+static OCLKernels kernels;
+static OCLKernels kernelsFp16;
+static std::mutex kernelsFp16Mutex;
+static std::string kernelOpts;
+static int kernelPixels = 1;
+static std::once_flag kernelsOnce;
+
+static void buildKernels(const std::string& opts)
+{
+	kernels = OCLKernels(icemet_hologram_ocl(opts), opts);
+	kernelsFp16 = OCLKernels();
+	kernelOpts = opts;
+	kernelPixels = opts.find("-D PIXEL_VEC4") != std::string::npos ? 4 : 1;
+}
+
+static void initKernels()
+{
+	// Vector loads and stores suit CPU runtimes, local memory tiles suit devices with dedicated local memory
+	std::call_once(kernelsOnce, []() {
+		if (!kernels.empty() || !cv::ocl::useOpenCL())
+			return;
+		const cv::ocl::Device& dev = cv::ocl::Device::getDefault();
+		std::vector<std::string> opts;
+		if (dev.type() == cv::ocl::Device::TYPE_CPU)
+			opts.push_back("-D PIXEL_VEC4");
+		if (dev.localMemType() == cv::ocl::Device::LOCAL_IS_LOCAL)
+			opts.push_back("-D FOCUS_TILED");
+		std::string str;
+		for (const auto& opt : opts)
+			str += (str.empty() ? "" : " ") + opt;
+		buildKernels(str);
+	});
+}
+
+static cv::ocl::Kernel kernel(const char* name, bool fp16=false)
 {
-	double min, max;
-	cv::minMaxLoc(slice, &min, &max);
-	return -min;
+	initKernels();
+	if (!fp16)
+		return kernels(name);
+	
+	// Half precision storage is a separate program, built when first needed
+	std::lock_guard<std::mutex> lock(kernelsFp16Mutex);
+	if (kernelsFp16.empty()) {
+		std::string opts = kernelOpts + (kernelOpts.empty() ? "" : " ") + "-D STORAGE_HALF";
+		kernelsFp16 = OCLKernels(icemet_hologram_ocl(opts), opts);
+	}
+	return kernelsFp16(name);
 }
 
-double scoreMax(const cv::UMat& slice)
+static void pixelSize(const cv::Size2i& size, size_t* gsize)
 {
-	double min, max;
-	cv::minMaxLoc(slice, &min, &max);
-	return max;
+	// Global size of the per-pixel kernels
+	initKernels();
+	gsize[0] = (size.width + kernelPixels-1) / kernelPixels;
+	gsize[1] = size.height;
 }
 
-double scoreRange(const cv::UMat& slice)
+// CPU backend, mirrors the kernels in icemet_hologram.cl
+static inline cv::Vec2f cmul(const cv::Vec2f& z1, const cv::Vec2f& z2)
 {
-	double min, max;
-	cv::minMaxLoc(slice, &min, &max);
-	return max - min;
+	return cv::Vec2f(
+		z1[0]*z2[0] - z1[1]*z2[1],
+		z1[0]*z2[1] + z1[1]*z2[0]
+	);
 }
 
-double scoreSTD(const cv::UMat& slice)
+static inline cv::Vec2f cexp(const cv::Vec2f& z)
 {
-	size_t gsize[2] = {(size_t)slice.cols, (size_t)slice.rows};
-	cv::UMat filt(slice.size(), CV_32FC1);
-	cv::ocl::Kernel("stdfilt_3x3", icemet_hologram_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(slice),
-		cv::ocl::KernelArg::WriteOnly(filt)
-	).run(2, gsize, NULL, true);
+	float expx = std::exp(z[0]);
+	return cv::Vec2f(expx * std::cos(z[1]), expx * std::sin(z[1]));
+}
+
+static inline float limit(float val)
+{
+	return std::min(std::max(val, 0.f), 255.f);
+}
+
+static inline float amplitude(const cv::Vec2f& val)
+{
+	return limit(std::sqrt(val[0]*val[0] + val[1]*val[1]));
+}
+
+static inline float phase(const cv::Vec2f& val)
+{
+	return limit(255.f * (std::atan(val[1] / val[0]) + PI/2) / PI);
+}
+
+static cv::Vec2f phaseCorrection(float lambda, float z)
+{
+	// e^(-i*atan(tan(2*pi*z/lambda))), the same for every pixel of the plane
+	double t = 2 * PI * (double)z / lambda;
+	double a = std::atan(std::sin(t) / std::cos(t));
+	return cv::Vec2f(std::cos(a), -std::sin(a));
+}
+
+static inline float reconValue(const cv::Vec2f& val, ReconOutput output, const cv::Vec2f& ph)
+{
+	return output == RECON_OUTPUT_AMPLITUDE ? amplitude(val) : phase(cmul(val, ph));
+}
+
+static void parallelRows(int rows, const std::function<void(int)>& f)
+{
+	cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& r) {
+		for (int y = r.start; y < r.end; y++)
+			f(y);
+	});
+}
+
+static void angularSpectrumCPU(cv::Mat& prop, const cv::Vec2f& size, float lambda)
+{
+	int w = prop.cols;
+	int h = prop.rows;
+	parallelRows(h, [&](int y) {
+		cv::Vec2f* p = prop.ptr<cv::Vec2f>(y);
+		float v = (float)(y < h/2 ? y : -(h - y)) / size[1];
+		for (int x = 0; x < w; x++) {
+			float u = (float)(x < w/2 ? x : -(w - x)) / size[0];
+			float root = std::sqrt(1 - lambda*lambda * (u*u + v*v));
+			p[x] = cv::Vec2f(0, 2 * PI * root / lambda);
+		}
+	});
+}
+
+static inline int quadrantIdx(int x, int y, int w, int h)
+{
+	int qx = x <= w/2 ? x : w - x;
+	int qy = y <= h/2 ? y : h - y;
+	return qy*(w/2 + 1) + qx;
+}
+
+#if CV_SIMD128
+static inline void sincos4(const cv::v_float32x4& x, cv::v_float32x4& s, cv::v_float32x4& c)
+{
+	// Cephes sinf/cosf: reduce to [-pi/4, pi/4] by octant and evaluate both minimax polynomials
+	const cv::v_int32x4 two = cv::v_setall_s32(2);
+	const cv::v_int32x4 four = cv::v_setall_s32(4);
+	const cv::v_float32x4 sign = cv::v_setall_f32(-0.f);
+	cv::v_float32x4 ax = cv::v_abs(x);
+	cv::v_int32x4 j = cv::v_trunc(ax * cv::v_setall_f32(4.f/PI));
+	j = (j + cv::v_setall_s32(1)) & cv::v_setall_s32(~1);
+	cv::v_float32x4 y = cv::v_cvt_f32(j);
+	cv::v_float32x4 r = cv::v_fma(y, cv::v_setall_f32(-0.78515625f), ax);
+	r = cv::v_fma(y, cv::v_setall_f32(-2.4187564849853515625e-4f), r);
+	r = cv::v_fma(y, cv::v_setall_f32(-3.77489497744594108e-8f), r);
+	cv::v_float32x4 r2 = r * r;
+	cv::v_float32x4 ps = cv::v_fma(r2, cv::v_setall_f32(-1.9515295891e-4f), cv::v_setall_f32(8.3321608736e-3f));
+	ps = cv::v_fma(ps, r2, cv::v_setall_f32(-1.6666654611e-1f));
+	ps = cv::v_fma(ps, r2 * r, r);
+	cv::v_float32x4 pc = cv::v_fma(r2, cv::v_setall_f32(2.443315711809948e-5f), cv::v_setall_f32(-1.388731625493765e-3f));
+	pc = cv::v_fma(pc, r2, cv::v_setall_f32(4.166664568298827e-2f));
+	pc = cv::v_fma(pc, r2 * r2, cv::v_fma(r2, cv::v_setall_f32(-0.5f), cv::v_setall_f32(1.f)));
 	
-	cv::Vec<double,1> mean;
-	cv::Vec<double,1> stddev;
-	cv::meanStdDev(filt, mean, stddev);
-	return stddev[0];
+	// Octants 2 and 6 swap the polynomials, the octant and the sign of x give the signs
+	cv::v_float32x4 swap = cv::v_reinterpret_as_f32((j & two) == two);
+	cv::v_float32x4 sinNeg = cv::v_reinterpret_as_f32((j & four) == four) ^ (x < cv::v_setzero_f32());
+	cv::v_float32x4 cosNeg = cv::v_reinterpret_as_f32(((j + two) & four) == four);
+	s = cv::v_select(swap, pc, ps) ^ (sinNeg & sign);
+	c = cv::v_select(swap, ps, pc) ^ (cosNeg & sign);
+}
+#endif
+
+static void propagateCPU(const cv::Mat& src, const cv::Mat& prop, const cv::Mat& filt, cv::Mat& dst, float z)
+{
+	const float* F = filt.empty() ? NULL : filt.ptr<float>();
+	parallelRows(src.rows, [&](int y) {
+		const cv::Vec2f* s = src.ptr<cv::Vec2f>(y);
+		const cv::Vec2f* p = prop.ptr<cv::Vec2f>(y);
+		cv::Vec2f* d = dst.ptr<cv::Vec2f>(y);
+		int x = 0;
+#if CV_SIMD128
+		// The angular spectrum is imaginary, so H = cos(z*k) + i*sin(z*k) times the filter, 4 pixels at a time
+		const cv::v_float32x4 vz = cv::v_setall_f32(z);
+		float f[4];
+		for (; x + 4 <= src.cols; x += 4) {
+			cv::v_float32x4 sr, si, pr, pi, hs, hc;
+			cv::v_load_deinterleave((const float*)(s + x), sr, si);
+			cv::v_load_deinterleave((const float*)(p + x), pr, pi);
+			sincos4(pi * vz, hs, hc);
+			if (F) {
+				for (int i = 0; i < 4; i++)
+					f[i] = F[quadrantIdx(x+i, y, src.cols, src.rows)];
+				cv::v_float32x4 vf = cv::v_load(f);
+				hs = hs * vf;
+				hc = hc * vf;
+			}
+			cv::v_store_interleave((float*)(d + x), sr*hc - si*hs, sr*hs + si*hc);
+		}
+#endif
+		for (; x < src.cols; x++) {
+			cv::Vec2f H = cexp(p[x] * z);
+			if (F)
+				H *= F[quadrantIdx(x, y, src.cols, src.rows)];
+			d[x] = cmul(s[x], H);
+		}
+	});
+}
+
+static void transferFunctionCPU(const cv::Mat& prop, const cv::Mat& filt, cv::Mat& dst, const std::vector<float>& z)
+{
+	int qw = prop.cols/2 + 1;
+	int qh = prop.rows/2 + 1;
+	const float* F = filt.empty() ? NULL : filt.ptr<float>();
+	parallelRows(dst.rows, [&](int k) {
+		cv::Vec2f* d = dst.ptr<cv::Vec2f>(k);
+		for (int qy = 0; qy < qh; qy++) {
+			const cv::Vec2f* p = prop.ptr<cv::Vec2f>(qy);
+			for (int qx = 0; qx < qw; qx++)
+				d[qy*qw + qx] = F ? cexp(p[qx] * z[k]) * F[qy*qw + qx] : cexp(p[qx] * z[k]);
+		}
+	});
+}
+
+static void propagateCachedCPU(const cv::Mat& src, const cv::Vec2f* H, cv::Mat& dst)
+{
+	parallelRows(src.rows, [&](int y) {
+		const cv::Vec2f* s = src.ptr<cv::Vec2f>(y);
+		cv::Vec2f* d = dst.ptr<cv::Vec2f>(y);
+		for (int x = 0; x < src.cols; x++)
+			d[x] = cmul(s[x], H[quadrantIdx(x, y, src.cols, src.rows)]);
+	});
+}
+
+static inline cv::Point2i ccsFreq(int x, int y, int w)
+{
+	// Frequency (u, v) of an element in the packed CCS spectrum of a real image
+	if (x == 0 || (w%2 == 0 && x == w-1))
+		return cv::Point2i(x == 0 ? 0 : w/2, (y+1)/2);
+	return cv::Point2i((x+1)/2, y);
+}
+
+static void expandCCSCPU(const cv::Mat& src, cv::Mat& dst, int part)
+{
+	int w = dst.cols;
+	parallelRows(dst.rows, [&](int y) {
+		float* d = dst.ptr<float>(y);
+		for (int x = 0; x < w; x++) {
+			cv::Point2i f = ccsFreq(x, y, w);
+			d[x] = src.at<cv::Vec2f>(f.y, f.x)[part];
+		}
+	});
+}
+
+static void propagateHalfCPU(const cv::Mat& src, const cv::Mat& prop, const cv::Mat& cache, const cv::Mat& filt, int idx, float z, cv::Mat& dst)
+{
+	int w = src.cols;
+	int h = src.rows;
+	const float* F = filt.empty() ? NULL : filt.ptr<float>();
+	cv::Mat re(src.size(), CV_32FC1);
+	cv::Mat im(src.size(), CV_32FC1);
+	parallelRows(h, [&](int y) {
+		const float* s = src.ptr<float>(y);
+		const float* p = prop.ptr<float>(y);
+		float* dre = re.ptr<float>(y);
+		float* dim = im.ptr<float>(y);
+		int x = 0;
+#if CV_SIMD128
+		if (idx < 0) {
+			const cv::v_float32x4 vz = cv::v_setall_f32(z);
+			float f[4];
+			for (; x + 4 <= w; x += 4) {
+				cv::v_float32x4 hs, hc;
+				sincos4(cv::v_load(p + x) * vz, hs, hc);
+				if (F) {
+					for (int i = 0; i < 4; i++) {
+						cv::Point2i fi = ccsFreq(x+i, y, w);
+						f[i] = F[quadrantIdx(fi.x, fi.y, w, h)];
+					}
+					cv::v_float32x4 vf = cv::v_load(f);
+					hs = hs * vf;
+					hc = hc * vf;
+				}
+				cv::v_float32x4 vs = cv::v_load(s + x);
+				cv::v_store(dre + x, vs * hc);
+				cv::v_store(dim + x, vs * hs);
+			}
+		}
+#endif
+		for (; x < w; x++) {
+			cv::Point2i f = ccsFreq(x, y, w);
+			int q = quadrantIdx(f.x, f.y, w, h);
+			cv::Vec2f H;
+			if (idx < 0) {
+				H = cv::Vec2f(std::cos(z * p[x]), std::sin(z * p[x]));
+				if (F)
+					H *= F[q];
+			}
+			else {
+				H = cache.ptr<cv::Vec2f>(idx)[q];
+			}
+			dre[x] = s[x] * H[0];
+			dim[x] = s[x] * H[1];
+		}
+	});
+	cv::idft(re, re, cv::DFT_REAL_OUTPUT);
+	cv::idft(im, im, cv::DFT_REAL_OUTPUT);
+	std::vector<cv::Mat> planes{re, im};
+	cv::merge(planes, dst);
+}
+
+static void reconCPU(const cv::Mat& src, cv::Mat& dst, ReconOutput out, const cv::Vec2f& ph)
+{
+	parallelRows(dst.rows, [&](int y) {
+		const cv::Vec2f* s = src.ptr<cv::Vec2f>(y);
+		float* d = dst.ptr<float>(y);
+		for (int x = 0; x < dst.cols; x++)
+			d[x] = reconValue(s[x], out, ph);
+	});
+}
+
+static void minCPU(const cv::Mat& src, cv::Mat& dst, ReconOutput out, const cv::Vec2f& ph)
+{
+	parallelRows(dst.rows, [&](int y) {
+		const cv::Vec2f* s = src.ptr<cv::Vec2f>(y);
+		uchar* d = dst.ptr<uchar>(y);
+		for (int x = 0; x < dst.cols; x++)
+			d[x] = std::min(d[x], (uchar)reconValue(s[x], out, ph));
+	});
+}
+
+static void reconMinCPU(const cv::Mat& src, cv::Mat& dst, cv::Mat& dstMin, ReconOutput out, const cv::Vec2f& ph)
+{
+	parallelRows(dst.rows, [&](int y) {
+		const cv::Vec2f* s = src.ptr<cv::Vec2f>(y);
+		uchar* d = dst.ptr<uchar>(y);
+		uchar* dmin = dstMin.ptr<uchar>(y);
+		for (int x = 0; x < dst.cols; x++) {
+			uchar a = amplitude(s[x]);
+			d[x] = a;
+			dmin[x] = std::min(dmin[x], out == RECON_OUTPUT_AMPLITUDE ? a : (uchar)phase(cmul(s[x], ph)));
+		}
+	});
+}
+
+static void reconMinBatchCPU(const cv::Mat& src, int srcRows, std::vector<cv::Mat>& dst, cv::Mat& dstMin, ReconOutput out, const std::vector<cv::Vec2f>& ph)
+{
+	int n = ph.size();
+	bool store = !dst.empty();
+	parallelRows(dstMin.rows, [&](int y) {
+		uchar* dmin = dstMin.ptr<uchar>(y);
+		for (int k = 0; k < n; k++) {
+			const cv::Vec2f* s = src.ptr<cv::Vec2f>(k*srcRows + y);
+			uchar* d = store ? dst[k].ptr<uchar>(y) : NULL;
+			for (int x = 0; x < dstMin.cols; x++) {
+				uchar a = amplitude(s[x]);
+				if (store)
+					d[x] = a;
+				dmin[x] = std::min(dmin[x], out == RECON_OUTPUT_AMPLITUDE ? a : (uchar)phase(cmul(s[x], ph[k])));
+			}
+		}
+	});
+}
+
+static void tilesCPU(const cv::Mat& src, float* dst)
+{
+	int tilesX = (src.cols + TILE-1) / TILE;
+	int tilesY = (src.rows + TILE-1) / TILE;
+	parallelRows(tilesY, [&](int ty) {
+		for (int tx = 0; tx < tilesX; tx++) {
+			cv::Mat tile(src, cv::Rect(tx*TILE, ty*TILE, std::min(TILE, src.cols-tx*TILE), std::min(TILE, src.rows-ty*TILE)));
+			cv::Scalar mean, stddev;
+			cv::meanStdDev(tile, mean, stddev);
+			dst[ty*tilesX + tx] = stddev[0]*stddev[0];
+		}
+	});
+}
+
+static float filterSigma(float f)
+{
+	return f * pow(log(1.0/pow(FILTER_F, 2)), -1.0/(2.0*FILTER_N));
+}
+
+static void supergaussianQuadrantCPU(cv::Mat& H, const cv::Vec2f& size, int type, float sigma, int n)
+{
+	// Multiplies the filter into one real quadrant, the filter is symmetric like the propagator
+	parallelRows(H.rows, [&](int qy) {
+		float* p = H.ptr<float>(qy);
+		float v = qy / size[1];
+		for (int qx = 0; qx < H.cols; qx++) {
+			float u = qx / size[0];
+			float filter = std::exp(-1.0/2.0 * std::pow(std::pow(u / sigma, 2) + std::pow(v / sigma, 2), n));
+			p[qx] *= type == 0 ? filter : 1-filter;
+		}
+	});
+}
+
+static void supergaussianCPU(cv::Mat& H, const cv::Vec2f& size, int type, const cv::Vec2f& sigma, int n)
+{
+	int w = H.cols;
+	int h = H.rows;
+	parallelRows(h, [&](int y) {
+		cv::Vec2f* p = H.ptr<cv::Vec2f>(y);
+		float v = (float)(y < h/2 ? y : -(h - y)) / size[1];
+		for (int x = 0; x < w; x++) {
+			float u = (float)(x < w/2 ? x : -(w - x)) / size[0];
+			float filter = std::exp(-1.0/2.0 * std::pow(std::pow(u / sigma[0], 2) + std::pow(v / sigma[1], 2), n));
+			p[x] = cv::Vec2f(type == 0 ? filter : 1-filter, 0.0);
+		}
+	});
+}
+
+static inline float focusValCPU(const cv::Mat& src, int x, int y, FocusFilter filter)
+{
+	int w = src.cols;
+	int h = src.rows;
+	if (filter == FOCUS_FILTER_STD) {
+		float sum = 0.0;
+		float sqsum = 0.0;
+		int n = 0;
+		for (int yy = std::max(y-1, 0); yy <= std::min(y+1, h-1); yy++) {
+			const float* s = src.ptr<float>(yy);
+			for (int xx = std::max(x-1, 0); xx <= std::min(x+1, w-1); xx++) {
+				sum += s[xx];
+				sqsum += s[xx]*s[xx];
+				n++;
+			}
+		}
+		float mean = sum / n;
+		return std::sqrt(std::fabs(sqsum / n - mean*mean));
+	}
+	else if (filter == FOCUS_FILTER_GRAD) {
+		float valx = 0.0;
+		float valy = 0.0;
+		if (x > 0)
+			valx -= 0.5*src.at<float>(y, x-1);
+		if (x < w-1)
+			valx += 0.5*src.at<float>(y, x+1);
+		if (y > 0)
+			valy -= 0.5*src.at<float>(y-1, x);
+		if (y < h-1)
+			valy += 0.5*src.at<float>(y+1, x);
+		return valx*valx + valy*valy;
+	}
+	return src.at<float>(y, x);
 }
 
-double scoreToG(const cv::UMat& slice)
+static FocusStats focusStatsCPU(const cv::UMat& slice, FocusFilter filter)
 {
-	size_t gsize[2] = {(size_t)slice.cols, (size_t)slice.rows};
-	cv::UMat fx(slice.size(), CV_32FC1);
-	cv::UMat fy(slice.size(), CV_32FC1);
-	cv::ocl::Kernel("gradient", icemet_hologram_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(slice),
-		cv::ocl::KernelArg::PtrWriteOnly(fx),
-		cv::ocl::KernelArg::WriteOnly(fy)
-	).run(2, gsize, NULL, true);
+	cv::Mat src;
+	slice.getMat(cv::ACCESS_READ).convertTo(src, CV_32FC1);
+	FocusStats stats{std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), 0.0, 0.0, src.rows*src.cols};
+	for (int y = 0; y < src.rows; y++) {
+		for (int x = 0; x < src.cols; x++) {
+			double val = focusValCPU(src, x, y, filter);
+			stats.min = std::min(stats.min, val);
+			stats.max = std::max(stats.max, val);
+			stats.sum += val;
+			stats.sqsum += val*val;
+		}
+	}
+	return stats;
+}
+
+// Inputs of the propagation, the spectrum is in CCS layout with the half spectrum
+typedef struct _propagator {
+	cv::UMat spectrum;
+	cv::UMat prop; // Angular spectrum, or its imaginary part in CCS layout with the half spectrum
+	cv::UMat cache;
+	cv::UMat filter;
+	bool half;
+	bool fp16;
+} Propagator;
+
+// Device specific part of the reconstruction, chosen when a Hologram is created
+class HologramBackend {
+public:
+	virtual ~HologramBackend() {}
+	
+	static cv::Ptr<HologramBackend> create();
+	
+	virtual size_t memory() const = 0;
+	virtual size_t maxAlloc() const = 0;
+	virtual bool fp16() const = 0;
+	virtual int batchSize(size_t mem, size_t planeBytes) const = 0;
+	
+	virtual void angularSpectrum(cv::UMat& prop, const cv::Vec2f& size, float lambda) = 0;
+	virtual void supergaussian(cv::UMat& H, const cv::Vec2f& size, int type, const cv::Vec2f& sigma, int n) = 0;
+	virtual void expandCCS(const cv::UMat& src, cv::UMat& dst, int part) = 0;
+	virtual void transferFunction(const cv::UMat& prop, const cv::UMat& filt, const std::vector<float>& z, cv::UMat& dst) = 0;
 	
-	cv::UMat filt;
-	cv::pow(fx, 2, fx);
-	cv::pow(fy, 2, fy);
-	cv::add(fx, fy, filt);
+	// Field of the plane at z (magnified) into dst, idx is the cached transfer function or -1
+	virtual void propagate(const Propagator& p, float z, int idx, cv::UMat& dst) = 0;
+	// Fields of n planes into batch, returns the element strides of x, y and plane.
+	// batch may be replaced by a buffer holding the planes in another layout.
+	virtual cv::Vec3i propagateBatch(const Propagator& p, const std::vector<float>& z, const std::vector<int>& idx, cv::UMat& batch) = 0;
+	
+	virtual void recon(const cv::UMat& src, cv::UMat& dst, ReconOutput output, const cv::Vec2f& ph) = 0;
+	virtual void min(const cv::UMat& src, cv::UMat& dst, ReconOutput output, const cv::Vec2f& ph) = 0;
+	virtual void reconMin(const cv::UMat& src, cv::UMat& dst, cv::UMat& dstMin, ReconOutput output, const cv::Vec2f& ph) = 0;
+	// dst holds the planes to store, or is empty if only dstMin is written. The tile variances go to rows tilesFirst...
+	virtual void reconMinBatch(const cv::UMat& batch, const cv::Vec3i& strides, const std::vector<cv::UMat>& dst, cv::UMat& dstMin, ReconOutput output, const std::vector<cv::Vec2f>& ph, cv::UMat* tiles, int tilesFirst) = 0;
+	virtual void tiles(const cv::UMat& src, cv::UMat& dst, int idx) = 0;
+	
+	virtual void focusStats(const std::vector<cv::UMat>& slices, FocusFilter filter, std::vector<FocusStats>& dst) = 0;
+	// Statistics of (rect, plane) probes, filters are per rect
+	virtual void probeStats(const std::vector<cv::UMat>& src, const std::vector<cv::Rect>& rects, const std::vector<FocusFilter>& filters, const std::vector<std::pair<int,int>>& probes, std::vector<FocusStats>& dst) = 0;
+};
+
+class HologramCPU : public HologramBackend {
+public:
+	size_t memory() const override { return hostMemory(); }
+	size_t maxAlloc() const override { return std::numeric_limits<size_t>::max(); }
+	bool fp16() const override { return false; }
+	
+	int batchSize(size_t, size_t) const override
+	{
+		// One plane per thread
+		return cv::getNumThreads();
+	}
+	
+	void angularSpectrum(cv::UMat& prop, const cv::Vec2f& size, float lambda) override
+	{
+		cv::Mat mat = prop.getMat(cv::ACCESS_WRITE);
+		angularSpectrumCPU(mat, size, lambda);
+	}
+	
+	void supergaussian(cv::UMat& H, const cv::Vec2f& size, int type, const cv::Vec2f& sigma, int n) override
+	{
+		cv::Mat mat = H.getMat(cv::ACCESS_WRITE);
+		supergaussianCPU(mat, size, type, sigma, n);
+	}
+	
+	void expandCCS(const cv::UMat& src, cv::UMat& dst, int part) override
+	{
+		cv::Mat mat = dst.getMat(cv::ACCESS_WRITE);
+		expandCCSCPU(src.getMat(cv::ACCESS_READ), mat, part);
+	}
+	
+	void transferFunction(const cv::UMat& prop, const cv::UMat& filt, const std::vector<float>& z, cv::UMat& dst) override
+	{
+		cv::Mat mat = dst.getMat(cv::ACCESS_WRITE);
+		transferFunctionCPU(prop.getMat(cv::ACCESS_READ), filt.getMat(cv::ACCESS_READ), mat, z);
+	}
+	
+	void propagate(const Propagator& p, float z, int idx, cv::UMat& dst) override
+	{
+		{
+			cv::Mat src = p.spectrum.getMat(cv::ACCESS_READ);
+			cv::Mat mat = dst.getMat(cv::ACCESS_WRITE);
+			if (p.half)
+				propagateHalfCPU(src, p.prop.getMat(cv::ACCESS_READ), p.cache.getMat(cv::ACCESS_READ), p.filter.getMat(cv::ACCESS_READ), idx, z, mat);
+			else if (idx >= 0)
+				propagateCachedCPU(src, p.cache.getMat(cv::ACCESS_READ).ptr<cv::Vec2f>(idx), mat);
+			else
+				propagateCPU(src, p.prop.getMat(cv::ACCESS_READ), p.filter.getMat(cv::ACCESS_READ), mat, z);
+		}
+		if (!p.half)
+			cv::idft(dst, dst, cv::DFT_COMPLEX_INPUT|cv::DFT_COMPLEX_OUTPUT);
+	}
+	
+	cv::Vec3i propagateBatch(const Propagator& p, const std::vector<float>& z, const std::vector<int>& idx, cv::UMat& batch) override
+	{
+		// One plane per thread, the planes are left in order
+		const int n = z.size();
+		const int w = p.spectrum.cols;
+		const int h = p.spectrum.rows;
+		cv::Mat src = p.spectrum.getMat(cv::ACCESS_READ);
+		cv::Mat prop = p.prop.getMat(cv::ACCESS_READ);
+		cv::Mat cache = p.cache.getMat(cv::ACCESS_READ);
+		cv::Mat filt = p.filter.getMat(cv::ACCESS_READ);
+		cv::Mat mat = batch.getMat(cv::ACCESS_RW);
+		cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& r) {
+			for (int k = r.start; k < r.end; k++) {
+				cv::Mat plane = mat.rowRange(k*h, (k+1)*h);
+				if (p.half) {
+					propagateHalfCPU(src, prop, cache, filt, idx[k], z[k], plane);
+					continue;
+				}
+				if (idx[k] >= 0)
+					propagateCachedCPU(src, cache.ptr<cv::Vec2f>(idx[k]), plane);
+				else
+					propagateCPU(src, prop, filt, plane, z[k]);
+				cv::idft(plane, plane, cv::DFT_COMPLEX_INPUT|cv::DFT_COMPLEX_OUTPUT);
+			}
+		});
+		return cv::Vec3i(1, w, w*h);
+	}
+	
+	void recon(const cv::UMat& src, cv::UMat& dst, ReconOutput output, const cv::Vec2f& ph) override
+	{
+		cv::Mat mat = dst.getMat(cv::ACCESS_WRITE);
+		reconCPU(src.getMat(cv::ACCESS_READ), mat, output, ph);
+	}
+	
+	void min(const cv::UMat& src, cv::UMat& dst, ReconOutput output, const cv::Vec2f& ph) override
+	{
+		cv::Mat mat = dst.getMat(cv::ACCESS_RW);
+		minCPU(src.getMat(cv::ACCESS_READ), mat, output, ph);
+	}
+	
+	void reconMin(const cv::UMat& src, cv::UMat& dst, cv::UMat& dstMin, ReconOutput output, const cv::Vec2f& ph) override
+	{
+		cv::Mat mat = dst.getMat(cv::ACCESS_WRITE);
+		cv::Mat matMin = dstMin.getMat(cv::ACCESS_RW);
+		reconMinCPU(src.getMat(cv::ACCESS_READ), mat, matMin, output, ph);
+	}
+	
+	void reconMinBatch(const cv::UMat& batch, const cv::Vec3i& strides, const std::vector<cv::UMat>& dst, cv::UMat& dstMin, ReconOutput output, const std::vector<cv::Vec2f>& ph, cv::UMat* tiles, int tilesFirst) override
+	{
+		std::vector<cv::Mat> mats;
+		for (const auto& plane : dst)
+			mats.push_back(plane.getMat(cv::ACCESS_WRITE));
+		cv::Mat matMin = dstMin.getMat(cv::ACCESS_RW);
+		reconMinBatchCPU(batch.getMat(cv::ACCESS_READ), strides[2] / strides[1], mats, matMin, output, ph);
+		if (tiles && !mats.empty()) {
+			cv::Mat matTiles = tiles->getMat(cv::ACCESS_WRITE);
+			for (size_t k = 0; k < mats.size(); k++)
+				tilesCPU(mats[k], matTiles.ptr<float>(tilesFirst+k));
+		}
+	}
+	
+	void tiles(const cv::UMat& src, cv::UMat& dst, int idx) override
+	{
+		cv::Mat matTiles = dst.getMat(cv::ACCESS_WRITE);
+		tilesCPU(src.getMat(cv::ACCESS_READ), matTiles.ptr<float>(idx));
+	}
+	
+	void focusStats(const std::vector<cv::UMat>& slices, FocusFilter filter, std::vector<FocusStats>& dst) override
+	{
+		dst.resize(slices.size());
+		cv::parallel_for_(cv::Range(0, slices.size()), [&](const cv::Range& r) {
+			for (int i = r.start; i < r.end; i++)
+				dst[i] = focusStatsCPU(slices[i], filter);
+		});
+	}
+	
+	void probeStats(const std::vector<cv::UMat>& src, const std::vector<cv::Rect>& rects, const std::vector<FocusFilter>& filters, const std::vector<std::pair<int,int>>& probes, std::vector<FocusStats>& dst) override
+	{
+		dst.resize(probes.size());
+		cv::parallel_for_(cv::Range(0, probes.size()), [&](const cv::Range& r) {
+			for (int p = r.start; p < r.end; p++) {
+				int roi = probes[p].first;
+				dst[p] = focusStatsCPU(cv::UMat(src[probes[p].second], rects[roi]), filters[roi]);
+			}
+		});
+	}
+};
+
+class HologramOCL : public HologramBackend {
+private:
+	cv::UMat m_ccsRe;
+	cv::UMat m_ccsIm;
+	cv::UMat m_transp;
+	cv::UMat m_z;
+	cv::UMat m_idx;
+	cv::UMat m_phase;
+
+public:
+	size_t memory() const override { return cv::ocl::Device::getDefault().globalMemSize(); }
+	size_t maxAlloc() const override { return cv::ocl::Device::getDefault().maxMemAllocSize(); }
+	bool fp16() const override { return true; }
+	
+	int batchSize(size_t mem, size_t planeBytes) const override
+	{
+		// Two complex planes per batch slot
+		return std::min(mem, maxAlloc()) / (2*planeBytes);
+	}
+	
+	void angularSpectrum(cv::UMat& prop, const cv::Vec2f& size, float lambda) override
+	{
+		size_t gsize[2] = {(size_t)prop.cols, (size_t)prop.rows};
+		oclRun(kernel("angularspectrum").args(
+			cv::ocl::KernelArg::WriteOnly(prop),
+			size,
+			lambda
+		), "angularspectrum", 2, gsize);
+	}
+	
+	void supergaussian(cv::UMat& H, const cv::Vec2f& size, int type, const cv::Vec2f& sigma, int n) override
+	{
+		size_t gsize[2] = {(size_t)H.cols, (size_t)H.rows};
+		oclRun(kernel("supergaussian").args(
+			cv::ocl::KernelArg::WriteOnly(H),
+			size,
+			type,
+			sigma,
+			n
+		), "supergaussian", 2, gsize);
+	}
 	
-	cv::Vec<double,1> mean;
-	cv::Vec<double,1> stddev;
-	cv::meanStdDev(filt, mean, stddev);
-	return -sqrt(stddev[0] / mean[0]);
+	void expandCCS(const cv::UMat& src, cv::UMat& dst, int part) override
+	{
+		size_t gsize[2] = {(size_t)dst.cols, (size_t)dst.rows};
+		oclRun(kernel("ccs_expand").args(
+			cv::ocl::KernelArg::PtrReadOnly(src),
+			cv::ocl::KernelArg::PtrWriteOnly(dst),
+			dst.cols, dst.rows,
+			part
+		), "ccs_expand", 2, gsize);
+	}
+	
+	void transferFunction(const cv::UMat& prop, const cv::UMat& filt, const std::vector<float>& z, cv::UMat& dst) override
+	{
+		cv::UMat zDev;
+		cv::Mat(1, z.size(), CV_32FC1, (void*)z.data()).copyTo(zDev);
+		size_t gsize[3] = {(size_t)prop.cols/2 + 1, (size_t)prop.rows/2 + 1, z.size()};
+		kernel("transferfunction", dst.depth() == CV_16F).args(
+			cv::ocl::KernelArg::PtrReadOnly(prop),
+			prop.cols, prop.rows,
+			cv::ocl::KernelArg::PtrWriteOnly(dst),
+			cv::ocl::KernelArg::PtrReadOnly(zDev),
+			cv::ocl::KernelArg::PtrReadOnly(filt.empty() ? prop : filt), // Unused without filter
+			(int)!filt.empty()
+		).run(3, gsize, NULL, false);
+	}
+	
+	void propagate(const Propagator& p, float z, int idx, cv::UMat& dst) override
+	{
+		const int w = p.spectrum.cols;
+		const int h = p.spectrum.rows;
+		if (p.half) {
+			// The spectrum of a real image is Hermitian and the propagator is even, so the field
+			// is IDFT(S*Re(H)) + i*IDFT(S*Im(H)) where both terms are real transforms of half spectra
+			m_ccsRe.create(h, w, CV_32FC1);
+			m_ccsIm.create(h, w, CV_32FC1);
+			size_t gsize[2] = {(size_t)w, (size_t)h};
+			oclRun(kernel("propagate_ccs", p.fp16).args(
+				cv::ocl::KernelArg::PtrReadOnly(p.spectrum),
+				cv::ocl::KernelArg::PtrReadOnly(p.prop),
+				cv::ocl::KernelArg::PtrReadOnly(p.cache.empty() ? p.prop : p.cache), // Unused without cache
+				cv::ocl::KernelArg::PtrWriteOnly(m_ccsRe),
+				cv::ocl::KernelArg::PtrWriteOnly(m_ccsIm),
+				z, idx, w, h,
+				cv::ocl::KernelArg::PtrReadOnly(p.filter.empty() ? p.prop : p.filter), // Unused without filter
+				(int)!p.filter.empty()
+			), "propagate_ccs", 2, gsize);
+			cv::idft(m_ccsRe, m_ccsRe, cv::DFT_REAL_OUTPUT);
+			cv::idft(m_ccsIm, m_ccsIm, cv::DFT_REAL_OUTPUT);
+			std::vector<cv::UMat> planes{m_ccsRe, m_ccsIm};
+			cv::merge(planes, dst);
+			return;
+		}
+		
+		size_t gsize[1] = {(size_t)w*h};
+		if (idx >= 0) {
+			kernel("propagate_cached", p.fp16).args(
+				cv::ocl::KernelArg::PtrReadOnly(p.spectrum),
+				cv::ocl::KernelArg::PtrReadOnly(p.cache),
+				cv::ocl::KernelArg::PtrWriteOnly(dst),
+				idx, w, h
+			).run(1, gsize, NULL, false);
+		}
+		else {
+			kernel("propagate", p.fp16).args(
+				cv::ocl::KernelArg::PtrReadOnly(p.spectrum),
+				cv::ocl::KernelArg::PtrReadOnly(p.prop),
+				cv::ocl::KernelArg::PtrWriteOnly(dst),
+				z,
+				cv::ocl::KernelArg::PtrReadOnly(p.filter.empty() ? p.prop : p.filter), // Unused without filter
+				(int)!p.filter.empty(), w, h
+			).run(1, gsize, NULL, false);
+		}
+		cv::idft(dst, dst, cv::DFT_COMPLEX_INPUT|cv::DFT_COMPLEX_OUTPUT);
+	}
+	
+	cv::Vec3i propagateBatch(const Propagator& p, const std::vector<float>& z, const std::vector<int>& idx, cv::UMat& batch) override
+	{
+		const int n = z.size();
+		const int w = p.spectrum.cols;
+		const int h = p.spectrum.rows;
+		const int size = w*h;
+		if (p.half) {
+			// Real transforms per plane, the planes are left in order
+			for (int k = 0; k < n; k++) {
+				cv::UMat plane = batch.rowRange(k*h, (k+1)*h);
+				propagate(p, z[k], idx[k], plane);
+			}
+			return cv::Vec3i(1, w, size);
+		}
+		
+		cv::Mat(1, n, CV_32FC1, (void*)z.data()).copyTo(m_z);
+		cv::Mat(1, n, CV_32SC1, (void*)idx.data()).copyTo(m_idx);
+		size_t gsize[2] = {(size_t)size, (size_t)n};
+		kernel("propagate_batch", p.fp16).args(
+			cv::ocl::KernelArg::PtrReadOnly(p.spectrum),
+			cv::ocl::KernelArg::PtrReadOnly(p.prop),
+			cv::ocl::KernelArg::PtrReadOnly(p.cache.empty() ? p.prop : p.cache), // Unused without cache
+			cv::ocl::KernelArg::PtrWriteOnly(batch),
+			cv::ocl::KernelArg::PtrReadOnly(m_z),
+			cv::ocl::KernelArg::PtrReadOnly(m_idx),
+			w, h,
+			cv::ocl::KernelArg::PtrReadOnly(p.filter.empty() ? p.prop : p.filter), // Unused without filter
+			(int)!p.filter.empty()
+		).run(2, gsize, NULL, false);
+		
+		// Batched 2D IDFT: rows of all planes, then rows of the transposed planes.
+		// The result is left transposed, plane k column x is row x*n + k.
+		if (m_transp.total() < (size_t)n*size)
+			m_transp.create(1, n*size, CV_32FC2);
+		cv::UMat transp = m_transp.colRange(0, n*size).reshape(0, w);
+		cv::idft(batch, batch, cv::DFT_ROWS|cv::DFT_COMPLEX_INPUT|cv::DFT_COMPLEX_OUTPUT);
+		cv::transpose(batch, transp);
+		transp = transp.reshape(0, w*n);
+		cv::idft(transp, transp, cv::DFT_ROWS|cv::DFT_COMPLEX_INPUT|cv::DFT_COMPLEX_OUTPUT);
+		batch = transp;
+		return cv::Vec3i(n*h, 1, h);
+	}
+	
+	void recon(const cv::UMat& src, cv::UMat& dst, ReconOutput output, const cv::Vec2f& ph) override
+	{
+		const char* kernelName = output == RECON_OUTPUT_AMPLITUDE ? "a_f32" : "p_f32";
+		size_t gsize[2];
+		pixelSize(src.size(), gsize);
+		oclRun(kernel(kernelName).args(
+			cv::ocl::KernelArg::ReadOnly(src),
+			cv::ocl::KernelArg::WriteOnly(dst),
+			ph
+		), kernelName, 2, gsize);
+	}
+	
+	void min(const cv::UMat& src, cv::UMat& dst, ReconOutput output, const cv::Vec2f& ph) override
+	{
+		const char* kernelName = output == RECON_OUTPUT_AMPLITUDE ? "amin_8u" : "pmin_8u";
+		size_t gsize[2];
+		pixelSize(src.size(), gsize);
+		oclRun(kernel(kernelName).args(
+			cv::ocl::KernelArg::ReadOnly(src),
+			cv::ocl::KernelArg::WriteOnly(dst),
+			ph
+		), kernelName, 2, gsize);
+	}
+	
+	void reconMin(const cv::UMat& src, cv::UMat& dst, cv::UMat& dstMin, ReconOutput output, const cv::Vec2f& ph) override
+	{
+		const char* kernelName = output == RECON_OUTPUT_AMPLITUDE ? "a_amin_8u" : "a_pmin_8u";
+		size_t gsize[2];
+		pixelSize(src.size(), gsize);
+		oclRun(kernel(kernelName).args(
+			cv::ocl::KernelArg::ReadOnly(src),
+			cv::ocl::KernelArg::WriteOnly(dst),
+			cv::ocl::KernelArg::PtrReadWrite(dstMin),
+			ph
+		), kernelName, 2, gsize);
+	}
+	
+	void reconMinBatch(const cv::UMat& batch, const cv::Vec3i& strides, const std::vector<cv::UMat>& dst, cv::UMat& dstMin, ReconOutput output, const std::vector<cv::Vec2f>& ph, cv::UMat* tiles, int tilesFirst) override
+	{
+		const int n = ph.size();
+		const bool store = !dst.empty();
+		if (output != RECON_OUTPUT_AMPLITUDE)
+			cv::Mat(1, n, CV_32FC2, (void*)ph.data()).copyTo(m_phase);
+		
+		// x is the fastest dimension. Whole tiles per work-group when the tile variances are
+		// computed in the same pass, or when the planes are transposed through local memory.
+		const bool group = tiles || strides[0] != 1;
+		size_t gsize[2] = {(size_t)dstMin.cols, (size_t)dstMin.rows};
+		size_t lsize[2] = {TILE, TILE};
+		if (group) {
+			gsize[0] = (gsize[0] + TILE-1) / TILE * TILE;
+			gsize[1] = (gsize[1] + TILE-1) / TILE * TILE;
+		}
+		kernel("amin_8u_batch").args(
+			cv::ocl::KernelArg::PtrReadOnly(batch),
+			strides[0], strides[1], strides[2], n,
+			cv::ocl::KernelArg::PtrWriteOnly(store ? dst[0] : dstMin), // Unused without dst
+			store ? (int)dst[0].offset : 0,
+			(int)store, dstMin.rows, dstMin.cols,
+			cv::ocl::KernelArg::PtrReadWrite(dstMin),
+			cv::ocl::KernelArg::PtrReadOnly(output != RECON_OUTPUT_AMPLITUDE ? m_phase : batch), // Unused with amplitude
+			(int)output,
+			cv::ocl::KernelArg::PtrWriteOnly(tiles ? *tiles : dstMin), // Unused without tiles
+			(int)(tiles != NULL), tilesFirst, (dstMin.cols + TILE-1) / TILE
+		).run(2, gsize, group ? lsize : NULL, false);
+	}
+	
+	void tiles(const cv::UMat& src, cv::UMat& dst, int idx) override
+	{
+		const int tilesX = (src.cols + TILE-1) / TILE;
+		const int tilesY = (src.rows + TILE-1) / TILE;
+		size_t gsize[2] = {(size_t)tilesY*TILE, (size_t)tilesX*TILE};
+		size_t lsize[2] = {TILE, TILE};
+		kernel("tiles_8u").args(
+			cv::ocl::KernelArg::ReadOnly(src),
+			cv::ocl::KernelArg::PtrWriteOnly(dst),
+			idx, tilesX
+		).run(2, gsize, lsize, false);
+	}
+	
+	void focusStats(const std::vector<cv::UMat>& slices, FocusFilter filter, std::vector<FocusStats>& dst) override
+	{
+		// One kernel launch per slice and a single readback
+		int n = slices.size();
+		dst.resize(n);
+		if (n == 0)
+			return;
+		
+		int area = slices[0].rows * slices[0].cols;
+		int groups = std::max(1, std::min(FOCUS_GROUPS, (area + FOCUS_LOCAL-1) / FOCUS_LOCAL));
+		size_t gsize[1] = {(size_t)groups*FOCUS_LOCAL};
+		size_t lsize[1] = {FOCUS_LOCAL};
+		cv::UMat partial(n, groups, CV_32FC4);
+		for (int i = 0; i < n; i++) {
+			kernel("focus_stats").args(
+				cv::ocl::KernelArg::ReadOnly(slices[i]),
+				cv::ocl::KernelArg::PtrWriteOnly(partial),
+				i,
+				(int)(slices[i].depth() == CV_32F),
+				(int)filter
+			).run(1, gsize, lsize, false);
+		}
+		
+		cv::Mat res = partial.getMat(cv::ACCESS_READ);
+		for (int i = 0; i < n; i++) {
+			const cv::Vec4f* p = res.ptr<cv::Vec4f>(i);
+			FocusStats stats{p[0][0], p[0][1], 0.0, 0.0, slices[i].rows*slices[i].cols};
+			for (int g = 0; g < groups; g++) {
+				stats.min = std::min(stats.min, (double)p[g][0]);
+				stats.max = std::max(stats.max, (double)p[g][1]);
+				stats.sum += p[g][2];
+				stats.sqsum += p[g][3];
+			}
+			dst[i] = stats;
+		}
+	}
+	
+	void probeStats(const std::vector<cv::UMat>& src, const std::vector<cv::Rect>& rects, const std::vector<FocusFilter>& filters, const std::vector<std::pair<int,int>>& probes, std::vector<FocusStats>& dst) override
+	{
+		// One launch per plane buffer and a single readback
+		int n = probes.size();
+		dst.resize(n);
+		
+		// Group the probes by the buffer holding their plane
+		std::map<cv::UMatData*,std::vector<int>> groups;
+		for (int p = 0; p < n; p++)
+			groups[src[probes[p].second].u].push_back(p);
+		
+		cv::Mat table(n, 6, CV_32SC1);
+		std::vector<int> order;
+		for (const auto& group : groups) {
+			for (int p : group.second) {
+				const cv::UMat& plane = src[probes[p].second];
+				const cv::Rect& rect = rects[probes[p].first];
+				int* t = table.ptr<int>(order.size());
+				t[0] = plane.offset;
+				t[1] = rect.x;
+				t[2] = rect.y;
+				t[3] = rect.width;
+				t[4] = rect.height;
+				t[5] = filters[probes[p].first];
+				order.push_back(p);
+			}
+		}
+		cv::UMat tableDev;
+		table.copyTo(tableDev);
+		cv::UMat res(n, 1, CV_32FC4);
+		
+		int first = 0;
+		for (const auto& group : groups) {
+			const cv::UMat& plane = src[probes[group.second[0]].second];
+			int count = group.second.size();
+			size_t gsize[1] = {(size_t)count*FOCUS_LOCAL};
+			size_t lsize[1] = {FOCUS_LOCAL};
+			kernel("focus_stats_multi").args(
+				cv::ocl::KernelArg::PtrReadOnly(plane),
+				(int)plane.step,
+				cv::ocl::KernelArg::PtrReadOnly(tableDev),
+				cv::ocl::KernelArg::PtrWriteOnly(res),
+				first, count,
+				(int)(plane.depth() == CV_32F)
+			).run(1, gsize, lsize, false);
+			first += count;
+		}
+		
+		cv::Mat resHost = res.getMat(cv::ACCESS_READ);
+		for (int k = 0; k < n; k++) {
+			const cv::Vec4f& v = resHost.at<cv::Vec4f>(k);
+			const cv::Rect& rect = rects[probes[order[k]].first];
+			dst[order[k]] = FocusStats{v[0], v[1], v[2], v[3], rect.area()};
+		}
+	}
+};
+
+cv::Ptr<HologramBackend> HologramBackend::create()
+{
+	if (cv::ocl::useOpenCL())
+		return cv::makePtr<HologramOCL>();
+	return cv::makePtr<HologramCPU>();
+}
+
+static double statsStd(const FocusStats& stats)
+{
+	double mean = stats.sum / stats.n;
+	return std::sqrt(std::max(0.0, stats.sqsum / stats.n - mean*mean));
+}
+
+double scoreMin(const FocusStats& stats)
+{
+	return -stats.min;
+}
+
+double scoreMax(const FocusStats& stats)
+{
+	return stats.max;
+}
+
+double scoreRange(const FocusStats& stats)
+{
+	return stats.max - stats.min;
+}
+
+double scoreSTD(const FocusStats& stats)
+{
+	return statsStd(stats);
+}
+
+double scoreToG(const FocusStats& stats)
+{
+	return -sqrt(statsStd(stats) / (stats.sum / stats.n));
 }
 
 static const FocusParam focusParam[] {
-	{CV_32FC1, RECON_OUTPUT_AMPLITUDE, scoreMin},
-	{CV_32FC1, RECON_OUTPUT_AMPLITUDE, scoreMax},
-	{CV_32FC1, RECON_OUTPUT_AMPLITUDE, scoreRange},
-	{CV_32FC1, RECON_OUTPUT_AMPLITUDE, scoreSTD},
-	{CV_32FC1, RECON_OUTPUT_AMPLITUDE, scoreToG}
+	{FOCUS_FILTER_NONE, RECON_OUTPUT_AMPLITUDE, scoreMin},
+	{FOCUS_FILTER_NONE, RECON_OUTPUT_AMPLITUDE, scoreMax},
+	{FOCUS_FILTER_NONE, RECON_OUTPUT_AMPLITUDE, scoreRange},
+	{FOCUS_FILTER_STD, RECON_OUTPUT_AMPLITUDE, scoreSTD},
+	{FOCUS_FILTER_GRAD, RECON_OUTPUT_AMPLITUDE, scoreToG}
 };
 
 static const FocusParam* getFocusParam(FocusMethod method)
@@ -123,124 +1128,481 @@ static const FocusParam* getFocusParam(FocusMethod method)
 	return &focusParam[method];
 }
 
-static double SSearch(std::function<double(double)> f, double begin, double end, double step, cv::TermCriteria termcrit=cv::TermCriteria(cv::TermCriteria::MAX_ITER+cv::TermCriteria::EPS, 1000, 1.0))
-{
-	CV_Assert(step > 0.0 && step < (end-begin)/2.0);
-	double nsteps = (end - begin) / step;
-	int count = 0;
-	while (count++ < termcrit.maxCount) {
+// Step search that can be advanced one round at a time
+class StepSearch {
+private:
+	double m_begin;
+	double m_end;
+	double m_step;
+	double m_nsteps;
+	int m_count;
+	bool m_done;
+	bool m_scan;
+	cv::TermCriteria m_termcrit;
+
+public:
+	StepSearch(double begin, double end, double step, cv::TermCriteria termcrit=cv::TermCriteria(cv::TermCriteria::MAX_ITER+cv::TermCriteria::EPS, 1000, 1.0)) :
+		m_begin(begin), m_end(end), m_step(step), m_nsteps((end - begin) / step),
+		m_count(0), m_done(false), m_scan(step >= (end-begin)/2.0), m_termcrit(termcrit)
+	{
+		// Ranges too short for the step are scanned exhaustively in a single round
+		CV_Assert(step > 0.0 && end >= begin);
+	}
+	
+	bool done() const { return m_done; }
+	double result() const { return (m_end + m_begin) / 2.0; }
+	
+	// Points evaluated by the next round
+	void points(std::vector<int>& idx) const
+	{
+		if (m_scan) {
+			for (int i = round(m_begin); i <= round(m_end); i++)
+				idx.push_back(i);
+			return;
+		}
+		for (double i = m_begin+m_step; i < m_end-m_step/2; i+=m_step) {
+			idx.push_back(round(i-m_step));
+			idx.push_back(round(i));
+			idx.push_back(round(std::min(m_end, i+m_step)));
+		}
+	}
+	
+	void advance(const std::function<double(double)>& f)
+	{
 		double fmax = -std::numeric_limits<double>::max();
 		double imax = 0.0;
-		for (double i = begin+step; i < end-step/2; i+=step) {
-			double fsum = f(i-step) + 2*f(i) + f(std::min(end, i+step));
+		if (m_scan) {
+			imax = round(m_begin);
+			for (int i = round(m_begin); i <= round(m_end); i++) {
+				double fi = f(i);
+				if (fi > fmax) {
+					fmax = fi;
+					imax = i;
+				}
+			}
+			m_begin = m_end = imax;
+			m_done = true;
+			return;
+		}
+		for (double i = m_begin+m_step; i < m_end-m_step/2; i+=m_step) {
+			double fsum = f(i-m_step) + 2*f(i) + f(std::min(m_end, i+m_step));
 			if (fsum > fmax) {
 				fmax = fsum;
 				imax = i;
 			}
 		}
-		begin = std::max(begin, imax - step);
-		end = std::min(end, imax + step);
-		if (step <= termcrit.epsilon) break;
-		step = std::max(termcrit.epsilon, (end - begin) / nsteps);
+		m_begin = std::max(m_begin, imax - m_step);
+		m_end = std::min(m_end, imax + m_step);
+		if (m_step <= m_termcrit.epsilon || ++m_count >= m_termcrit.maxCount)
+			m_done = true;
+		else
+			m_step = std::max(m_termcrit.epsilon, (m_end - m_begin) / m_nsteps);
 	}
-	return (end + begin) / 2.0;
+};
+
+static double SSearch(std::function<double(double)> f, double begin, double end, double step, std::function<void(const std::vector<int>&)> prefetch=nullptr)
+{
+	StepSearch search(begin, end, step);
+	while (!search.done()) {
+		// Let the caller evaluate all points of this round at once
+		if (prefetch) {
+			std::vector<int> idx;
+			search.points(idx);
+			prefetch(idx);
+		}
+		search.advance(f);
+	}
+	return search.result();
+}
+
+static void scorePlanes(HologramBackend& backend, std::map<int,double>& scores, std::vector<int> idx, const FocusParam* param, const std::function<cv::UMat(int)>& slice)
+{
+	std::sort(idx.begin(), idx.end());
+	idx.erase(std::unique(idx.begin(), idx.end()), idx.end());
+	std::vector<int> missing;
+	std::vector<cv::UMat> slices;
+	for (int i : idx) {
+		if (scores.find(i) == scores.end()) {
+			missing.push_back(i);
+			slices.push_back(slice(i));
+		}
+	}
+	
+	std::vector<FocusStats> stats;
+	backend.focusStats(slices, param->filter, stats);
+	for (size_t k = 0; k < missing.size(); k++)
+		scores[missing[k]] = param->scoreFunc(stats[k]);
+}
+
+// Scores of (ROI, plane) probes
+static void scoreProbes(HologramBackend& backend, const std::vector<cv::UMat>& src, const std::vector<cv::Rect>& rects, const std::vector<const FocusParam*>& params, const std::vector<std::pair<int,int>>& probes, std::vector<std::map<int,double>>& scores)
+{
+	int n = probes.size();
+	if (n == 0)
+		return;
+	
+	std::vector<FocusFilter> filters;
+	for (const FocusParam* param : params)
+		filters.push_back(param->filter);
+	std::vector<FocusStats> stats;
+	backend.probeStats(src, rects, filters, probes, stats);
+	for (int p = 0; p < n; p++)
+		scores[probes[p].first][probes[p].second] = params[probes[p].first]->scoreFunc(stats[p]);
+}
+
+// Offset of the peak of a parabola through the scores of three adjacent planes
+static double peakOffset(double s0, double s1, double s2)
+{
+	double d = s0 - 2*s1 + s2;
+	if (d >= 0.0)
+		return 0.0;
+	return std::max(-0.5, std::min(0.5, 0.5 * (s0 - s2) / d));
+}
+
+int Hologram::cacheIdx(float z) const
+{
+	auto it = m_cacheIdx.find(z);
+	return it != m_cacheIdx.end() ? it->second : -1;
 }
 
 void Hologram::propagate(float z)
 {
-	size_t gsizeProp[1] = {(size_t)(m_sizePad.width * m_sizePad.height)};
-	cv::ocl::Kernel("propagate", icemet_hologram_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(m_dft),
-		cv::ocl::KernelArg::PtrReadOnly(m_prop),
-		cv::ocl::KernelArg::PtrWriteOnly(m_complex),
-		z * magnf(m_dist, z)
-	).run(1, gsizeProp, NULL, true);
-	cv::idft(m_complex, m_complex, cv::DFT_COMPLEX_INPUT|cv::DFT_COMPLEX_OUTPUT);
+	Propagator p{m_dft, m_half ? m_propCCS : m_prop, m_cache, m_filter, m_half, m_fp16};
+	m_backend->propagate(p, z * magnf(m_dist, z), cacheIdx(z), m_complex);
+}
+
+cv::Vec3i Hologram::propagateBatch(const ZRange& range, int i0, int n, cv::UMat& batch)
+{
+	std::vector<float> z(n);
+	std::vector<int> idx(n);
+	for (int k = 0; k < n; k++) {
+		z[k] = range.z(i0+k) * magnf(m_dist, range.z(i0+k));
+		idx[k] = cacheIdx(range.z(i0+k));
+	}
+	
+	batch = m_batchComplex.rowRange(0, n*m_sizePad.height);
+	Propagator p{m_dft, m_half ? m_propCCS : m_prop, m_cache, m_filter, m_half, m_fp16};
+	return m_backend->propagateBatch(p, z, idx, batch);
+}
+
+void Hologram::expandCCS(const cv::UMat& src, cv::UMat& dst, int part) const
+{
+	dst = cv::UMat(m_sizePad, CV_32FC1);
+	m_backend->expandCCS(src, dst, part);
+}
+
+void Hologram::allocBatch()
+{
+	m_batchSize = m_batch;
+	if (m_batchSize <= 0) {
+		// Limited by the memory budget
+		size_t planeBytes = (size_t)m_sizePad.width * m_sizePad.height * 8;
+		m_batchSize = m_backend->batchSize(memory() / BATCH_MEM_DIV, planeBytes);
+		m_batchSize = std::max(1, std::min(BATCH_MAX, m_batchSize));
+	}
+	
+	if (m_batchSize > 1)
+		m_batchComplex = cv::UMat(m_batchSize*m_sizePad.height, m_sizePad.width, CV_32FC2);
+	else
+		m_batchComplex = cv::UMat();
+}
+
+void Hologram::allocStep()
+{
+	m_stepSize = m_step;
+	if (m_stepSize <= 0) {
+		// The plane stack gets what is left of the budget after the working buffers
+		size_t planeBytes = (size_t)m_sizePad.width * m_sizePad.height * 8;
+		size_t used = (3 + (m_batchSize > 1 ? 2*m_batchSize : 0)) * planeBytes + cacheSize();
+		size_t avail = memory() / STEP_MEM_DIV;
+		size_t n = avail > used ? (avail - used) / m_sizeOrig.area() : 0;
+		m_stepSize = (int)std::max((size_t)1, std::min((size_t)std::numeric_limits<int>::max(), n));
+	}
+}
+
+void Hologram::fillCache()
+{
+	m_cacheIdx.clear();
+	m_cache = cv::UMat();
+	
+	// The propagator is symmetric around the zero frequency, only one quadrant is stored
+	const int qw = m_sizePad.width/2 + 1;
+	const int qh = m_sizePad.height/2 + 1;
+	const size_t planeSize = (size_t)qw * qh * (m_fp16 ? 4 : 8);
+	const size_t maxSize = std::min(m_cacheMax, m_backend->maxAlloc());
+	const int n = std::min((size_t)m_cacheRange.n(), maxSize / planeSize);
+	if (n <= 0)
+		return;
+	
+	std::vector<float> z(n);
+	for (int k = 0; k < n; k++) {
+		float zk = m_cacheRange.z(k);
+		z[k] = zk * magnf(m_dist, zk);
+		m_cacheIdx[zk] = k;
+	}
+	
+	m_cache = cv::UMat(n, qw*qh, m_fp16 ? CV_16FC2 : CV_32FC2);
+	m_backend->transferFunction(m_prop, m_filter, z, m_cache);
+}
+
+void Hologram::fillFilter()
+{
+	m_filter = cv::UMat();
+	if (m_filters.empty())
+		return;
+	
+	// Fixed filters are multiplied into one real quadrant that is folded into the transfer functions
+	const int qw = m_sizePad.width/2 + 1;
+	const int qh = m_sizePad.height/2 + 1;
+	cv::Vec2f size(m_psz*m_sizePad.width, m_psz*m_sizePad.height);
+	cv::Mat H(qh, qw, CV_32FC1, cv::Scalar(1.0));
+	for (const auto& filter : m_filters)
+		supergaussianQuadrantCPU(H, size, filter.second, filterSigma(filter.first), FILTER_N);
+	H.reshape(1, 1).copyTo(m_filter);
+}
+
+void Hologram::reconMinBatch(std::vector<cv::UMat>* dst, cv::UMat& dstMin, const ZRange& range, ReconOutput output, cv::UMat* tiles)
+{
+	// Only the minimum image is written if dst is NULL
+	const int n = range.n();
+	const size_t planeBytes = (size_t)m_sizeOrig.width * m_sizeOrig.height;
+	if (dst) {
+		dst->resize(std::max((int)dst->size(), n));
+		
+		// Keep the whole stack in one buffer when possible so that it can be searched with single launches
+		bool contiguous = true;
+		for (int k = 0; k < n; k++) {
+			const cv::UMat& plane = (*dst)[k];
+			if (plane.empty() || plane.size() != m_sizeOrig || plane.u != (*dst)[0].u || plane.offset != (*dst)[0].offset + k*planeBytes)
+				contiguous = false;
+		}
+		if (!contiguous && n*planeBytes <= maxStackSize()) {
+			cv::UMat buf(n*m_sizeOrig.height, m_sizeOrig.width, CV_8UC1);
+			for (int k = 0; k < n; k++)
+				(*dst)[k] = buf.rowRange(k*m_sizeOrig.height, (k+1)*m_sizeOrig.height);
+		}
+	}
+	
+	for (int i0 = 0; i0 < n; i0 += m_batchSize) {
+		int nb = std::min(m_batchSize, n-i0);
+		
+		// The planes of a batch are views into one buffer so they can be written with a single launch
+		bool contiguous = true;
+		for (int k = 0; dst && k < nb; k++) {
+			const cv::UMat& plane = (*dst)[i0+k];
+			if (plane.empty() || plane.size() != m_sizeOrig || plane.u != (*dst)[i0].u || plane.offset != (*dst)[i0].offset + k*planeBytes)
+				contiguous = false;
+		}
+		if (!contiguous) {
+			cv::UMat buf(nb*m_sizeOrig.height, m_sizeOrig.width, CV_8UC1);
+			for (int k = 0; k < nb; k++)
+				(*dst)[i0+k] = buf.rowRange(k*m_sizeOrig.height, (k+1)*m_sizeOrig.height);
+		}
+		
+		cv::UMat batch;
+		cv::Vec3i strides = propagateBatch(range, i0, nb, batch);
+		std::vector<cv::Vec2f> ph(nb);
+		for (int k = 0; k < nb; k++) {
+			float z = range.z(i0+k);
+			ph[k] = phaseCorrection(m_lambda, z * magnf(m_dist, z));
+		}
+		std::vector<cv::UMat> planes;
+		if (dst)
+			planes.assign(dst->begin()+i0, dst->begin()+i0+nb);
+		m_backend->reconMinBatch(batch, strides, planes, dstMin, output, ph, tiles, i0);
+	}
 }
 
 Hologram::Hologram(float psz, float lambda, float dist) :
+	m_backend(HologramBackend::create()),
 	m_psz(psz),
 	m_lambda(lambda),
-	m_dist(dist) {}
+	m_dist(dist),
+	m_half(false),
+	m_fp16(false),
+	m_mem(0),
+	m_step(1),
+	m_stepSize(1),
+	m_batch(1),
+	m_batchSize(1),
+	m_cacheMax(0) {}
 
-void Hologram::setImg(const cv::UMat& img)
+void Hologram::setHalfSpectrum(bool half)
 {
-	CV_Assert(img.channels() == 1);
-	if (img.size() != m_sizeOrig) {
-		m_sizeOrig = img.size();
+	if (half != m_half) {
+		m_half = half;
+		
+		// Reallocate on the next setSize()
+		m_sizeOrig = cv::Size2i();
+	}
+}
+
+void Hologram::setFp16Storage(bool fp16)
+{
+	// The CPU backend always stores fp32
+	fp16 = fp16 && m_backend->fp16();
+	if (fp16 != m_fp16) {
+		m_fp16 = fp16;
+		
+		// Reallocate on the next setSize()
+		m_sizeOrig = cv::Size2i();
+	}
+}
+
+int Hologram::spectrumType() const
+{
+	return CV_MAKETYPE(m_fp16 ? CV_16F : CV_32F, m_half ? 1 : 2);
+}
+
+size_t Hologram::memory() const
+{
+	return m_mem > 0 ? m_mem : m_backend->memory();
+}
+
+void Hologram::setStep(int step)
+{
+	m_step = step;
+	if (!m_sizePad.empty())
+		allocStep();
+}
+
+void Hologram::setBatch(int batch)
+{
+	m_batch = batch;
+	if (!m_sizePad.empty()) {
+		allocBatch();
+		allocStep();
+	}
+}
+
+void Hologram::setCache(const ZRange& range, size_t maxSize)
+{
+	m_cacheRange = range;
+	m_cacheMax = maxSize;
+	if (!m_sizePad.empty()) {
+		fillCache();
+		allocStep();
+	}
+}
+
+void Hologram::setSize(const cv::Size2i& size)
+{
+	if (size != m_sizeOrig) {
+		m_sizeOrig = size;
 		m_sizePad = cv::Size2i(cv::getOptimalDFTSize(m_sizeOrig.width), cv::getOptimalDFTSize(m_sizeOrig.height));
 		
 		// Allocate cv::UMats
 		m_prop = cv::UMat::zeros(m_sizePad, CV_32FC2);
-		m_dft = cv::UMat::zeros(m_sizePad, CV_32FC2);
+		m_dft = cv::UMat::zeros(m_sizePad, spectrumType());
+		m_input = cv::UMat(m_sizePad, CV_32FC1);
 		m_complex = cv::UMat::zeros(m_sizePad, CV_32FC2);
 		
 		// Fill propagator
-		size_t gsize[2] = {(size_t)m_sizePad.width, (size_t)m_sizePad.height};
-		cv::ocl::Kernel("angularspectrum", icemet_hologram_ocl()).args(
-			cv::ocl::KernelArg::WriteOnly(m_prop),
-			cv::Vec2f(m_psz*m_sizePad.width, m_psz*m_sizePad.height),
-			m_lambda
-		).run(2, gsize, NULL, true);
+		cv::Vec2f size(m_psz*m_sizePad.width, m_psz*m_sizePad.height);
+		m_backend->angularSpectrum(m_prop, size, m_lambda);
+		if (m_half)
+			expandCCS(m_prop, m_propCCS, 1);
+		else
+			m_propCCS = cv::UMat();
+		allocBatch();
+		fillFilter();
+		fillCache();
+		allocStep();
 	}
+}
+
+void Hologram::setImg(const cv::UMat& img)
+{
+	CV_Assert(img.channels() == 1);
+	setSize(img.size());
+	cv::UMat dst = input();
+	img.convertTo(dst, CV_32FC1);
+	setInput(cv::mean(img)[0]);
+}
+
+cv::UMat Hologram::input()
+{
+	CV_Assert(!m_sizePad.empty());
+	return cv::UMat(m_input, cv::Rect(cv::Point(0, 0), m_sizeOrig));
+}
+
+void Hologram::setInput(double mean)
+{
+	// Pad with the mean
+	cv::UMat(m_input, cv::Rect(m_sizeOrig.width, 0, m_sizePad.width-m_sizeOrig.width, m_sizePad.height)).setTo(mean);
+	cv::UMat(m_input, cv::Rect(0, m_sizeOrig.height, m_sizeOrig.width, m_sizePad.height-m_sizeOrig.height)).setTo(mean);
 	
-	cv::UMat padded(m_sizePad, CV_32FC1, cv::mean(img));
-	img.convertTo(cv::UMat(padded, cv::Rect(cv::Point(0, 0), m_sizeOrig)), CV_32FC1);
-	
-	// FFT
-	cv::dft(padded, m_dft, cv::DFT_COMPLEX_OUTPUT|cv::DFT_SCALE, m_sizeOrig.height);
+	// FFT, packed CCS output in the half spectrum mode
+	int flags = m_half ? cv::DFT_SCALE : cv::DFT_COMPLEX_OUTPUT|cv::DFT_SCALE;
+	if (m_fp16) {
+		cv::UMat dft;
+		cv::dft(m_input, dft, flags, m_sizeOrig.height);
+		dft.convertTo(m_dft, CV_16F);
+	}
+	else {
+		cv::dft(m_input, m_dft, flags, m_sizeOrig.height);
+	}
+}
+
+void Hologram::setSpectrum(const cv::UMat& spectrum, const cv::Size2i& size)
+{
+	setSize(size);
+	CV_Assert(spectrum.size() == m_sizePad && spectrum.type() == spectrumType());
+	m_dft = spectrum;
+}
+
+void Hologram::takeSpectrum(cv::UMat& dst)
+{
+	// The next setImg() allocates a new buffer
+	dst = m_dft;
+	m_dft = cv::UMat();
 }
 
 void Hologram::recon(cv::UMat& dst, float z, ReconOutput output)
 {
-	size_t gsize[2] = {(size_t)m_sizePad.width, (size_t)m_sizePad.height};
 	propagate(z);
-	
 	if (output == RECON_OUTPUT_COMPLEX) {
 		cv::UMat(m_complex, cv::Rect(cv::Point(0, 0), m_sizeOrig)).copyTo(dst);
 	}
 	else {
-		const char* kernelName = output == RECON_OUTPUT_AMPLITUDE ? "a_f32" : "p_f32";
 		if (dst.empty())
 			dst = cv::UMat(m_sizeOrig, CV_32FC1);
-		cv::ocl::Kernel(kernelName, icemet_hologram_ocl()).args(
-			cv::ocl::KernelArg::ReadOnly(m_complex),
-			cv::ocl::KernelArg::WriteOnly(dst),
-			m_lambda,
-			z * magnf(m_dist, z)
-		).run(2, gsize, NULL, true);
+		m_backend->recon(m_complex, dst, output, phaseCorrection(m_lambda, z * magnf(m_dist, z)));
 	}
 }
 
 void Hologram::min(cv::UMat& dst, const ZRange& range, ReconOutput output)
 {
-	const char* kernelName = output == RECON_OUTPUT_AMPLITUDE ? "amin_8u" : "pmin_8u";
-	size_t gsize[2] = {(size_t)m_sizePad.width, (size_t)m_sizePad.height};
-	int n = range.n();
-	
 	if (dst.empty())
 		dst = cv::UMat(m_sizeOrig, CV_8UC1, cv::Scalar(255));
+	if (m_batchSize > 1) {
+		reconMinBatch(NULL, dst, range, output, NULL);
+		return;
+	}
 	
-	for (int i = 0; i < n; i++) {
+	for (int i = 0; i < range.n(); i++) {
 		float z = range.z(i);
 		propagate(z);
-		cv::ocl::Kernel(kernelName, icemet_hologram_ocl()).args(
-			cv::ocl::KernelArg::ReadOnly(m_complex),
-			cv::ocl::KernelArg::WriteOnly(dst),
-			m_lambda,
-			z * magnf(m_dist, z)
-		).run(2, gsize, NULL, true);
+		m_backend->min(m_complex, dst, output, phaseCorrection(m_lambda, z * magnf(m_dist, z)));
 	}
 }
 
-void Hologram::reconMin(std::vector<cv::UMat>& dst, cv::UMat& dstMin, const ZRange& range, ReconOutput output)
+void Hologram::reconMin(std::vector<cv::UMat>& dst, cv::UMat& dstMin, const ZRange& range, ReconOutput output, cv::UMat* tiles)
 {
-	const char* kernelName = output == RECON_OUTPUT_AMPLITUDE ? "a_amin_8u" : "a_pmin_8u";
-	size_t gsize[2] = {(size_t)m_sizePad.width, (size_t)m_sizePad.height};
 	int n = range.n();
 	
+	// Amplitude variance of every TILE x TILE tile of every plane
+	const int tilesX = (m_sizeOrig.width + TILE-1) / TILE;
+	const int tilesY = (m_sizeOrig.height + TILE-1) / TILE;
+	if (tiles)
+		tiles->create(n, tilesX*tilesY, CV_32FC1);
+	
 	if (dstMin.empty())
 		dstMin = cv::UMat(m_sizeOrig, CV_8UC1, cv::Scalar(255));
+	if (m_batchSize > 1) {
+		reconMinBatch(&dst, dstMin, range, output, tiles);
+		return;
+	}
 	int empty = n - dst.size();
 	for (int i = 0; i < empty; i++)
 		dst.emplace_back(m_sizeOrig, CV_8UC1);
@@ -248,82 +1610,178 @@ void Hologram::reconMin(std::vector<cv::UMat>& dst, cv::UMat& dstMin, const ZRan
 	for (int i = 0; i < n; i++) {
 		float z = range.z(i);
 		propagate(z);
-		cv::ocl::Kernel(kernelName, icemet_hologram_ocl()).args(
-			cv::ocl::KernelArg::ReadOnly(m_complex),
-			cv::ocl::KernelArg::WriteOnly(dst[i]),
-			cv::ocl::KernelArg::PtrReadWrite(dstMin),
-			m_lambda,
-			z * magnf(m_dist, z)
-		).run(2, gsize, NULL, true);
+		m_backend->reconMin(m_complex, dst[i], dstMin, output, phaseCorrection(m_lambda, z * magnf(m_dist, z)));
+		
+		// Unbatched planes are only written one at a time, so the tiles are read from the stored plane
+		if (tiles)
+			m_backend->tiles(dst[i], *tiles, i);
+	}
+}
+
+void Hologram::tune(float z)
+{
+	// Work-group sizes of the 2D kernels for the current image size, see oclTune()
+	CV_Assert(!m_sizePad.empty() && cv::ocl::useOpenCL());
+	const size_t gsize[2] = {(size_t)m_sizePad.width, (size_t)m_sizePad.height};
+	size_t gsizePixel[2];
+	pixelSize(m_sizePad, gsizePixel);
+	const cv::Vec2f ph = phaseCorrection(m_lambda, z * magnf(m_dist, z));
+	const cv::Vec2f size(m_psz*m_sizePad.width, m_psz*m_sizePad.height);
+	cv::UMat dst32(m_sizeOrig, CV_32FC1);
+	cv::UMat dst8(m_sizeOrig, CV_8UC1);
+	cv::UMat dstMin(m_sizeOrig, CV_8UC1, cv::Scalar(255));
+	cv::UMat prop(m_sizePad, CV_32FC2);
+	cv::UMat ccs(m_sizePad, CV_32FC1);
+	cv::UMat ccsIm(m_sizePad, CV_32FC1);
+	propagate(z);
+	
+	// The first six are the per-pixel kernels
+	std::vector<std::pair<const char*,std::function<cv::ocl::Kernel&(cv::ocl::Kernel&)>>> tuned{
+		{"a_f32", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::ReadOnly(m_complex), cv::ocl::KernelArg::WriteOnly(dst32), ph);
+		}},
+		{"p_f32", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::ReadOnly(m_complex), cv::ocl::KernelArg::WriteOnly(dst32), ph);
+		}},
+		{"amin_8u", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::ReadOnly(m_complex), cv::ocl::KernelArg::WriteOnly(dstMin), ph);
+		}},
+		{"pmin_8u", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::ReadOnly(m_complex), cv::ocl::KernelArg::WriteOnly(dstMin), ph);
+		}},
+		{"a_amin_8u", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::ReadOnly(m_complex), cv::ocl::KernelArg::WriteOnly(dst8), cv::ocl::KernelArg::PtrReadWrite(dstMin), ph);
+		}},
+		{"a_pmin_8u", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::ReadOnly(m_complex), cv::ocl::KernelArg::WriteOnly(dst8), cv::ocl::KernelArg::PtrReadWrite(dstMin), ph);
+		}},
+		{"angularspectrum", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::WriteOnly(prop), size, m_lambda);
+		}},
+		{"supergaussian", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::WriteOnly(prop), size, (int)FILTER_LOWPASS, cv::Vec2f(1e5, 1e5), FILTER_N);
+		}},
+		{"ccs_expand", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(cv::ocl::KernelArg::PtrReadOnly(m_prop), cv::ocl::KernelArg::PtrWriteOnly(ccs), m_sizePad.width, m_sizePad.height, 0);
+		}}
+	};
+	if (m_half) {
+		tuned.push_back({"propagate_ccs", [&](cv::ocl::Kernel& k) -> cv::ocl::Kernel& {
+			return k.args(
+				cv::ocl::KernelArg::PtrReadOnly(m_dft),
+				cv::ocl::KernelArg::PtrReadOnly(m_propCCS),
+				cv::ocl::KernelArg::PtrReadOnly(m_propCCS),
+				cv::ocl::KernelArg::PtrWriteOnly(ccs),
+				cv::ocl::KernelArg::PtrWriteOnly(ccsIm),
+				z, -1, m_sizePad.width, m_sizePad.height,
+				cv::ocl::KernelArg::PtrReadOnly(m_propCCS), 0
+			);
+		}});
+	}
+	
+	for (int i = 0; i < (int)tuned.size(); i++) {
+		const auto& k = tuned[i];
+		oclTune(k.first, 2, i < 6 ? gsizePixel : gsize, [&](const size_t* g, const size_t* l) {
+			cv::ocl::Kernel tmp = kernel(k.first, m_fp16);
+			return k.second(tmp).run(2, (size_t*)g, (size_t*)l, false);
+		});
 	}
 }
 
 float Hologram::focus(const ZRange& range, FocusMethod method, double step)
 {
 	const FocusParam* param = getFocusParam(method);
-	cv::UMat slice(m_sizeOrig, param->type);
+	cv::UMat plane(m_sizeOrig, CV_32FC1);
 	std::map<int,double> scores;
+	auto slice = [&](int i) {
+		recon(plane, range.z(i), param->output);
+		return plane;
+	};
 	auto f = [&](double x) {
 		int i = round(x);
-		auto it = scores.find(i);
-		if (it != scores.end()) {
-			return it->second;
-		}
-		else {
-			recon(slice, range.z(i), param->output);
-			double newScore = param->scoreFunc(slice);
-			scores[i] = newScore;
-			return newScore;
-		}
+		scorePlanes(*m_backend, scores, {i}, param, slice);
+		return scores[i];
 	};
 	return range.z(SSearch(f, 0, range.n()-1, step));
 }
 
-float Hologram::focus(const ZRange& range, std::vector<cv::UMat>& src, const cv::Rect& rect, int &idx, double &score, FocusMethod method, double step)
+float Hologram::focus(const ZRange& range, std::vector<cv::UMat>& src, const cv::Rect& rect, int &idx, double &score, FocusMethod method, double step, double* frac)
 {
 	const FocusParam* param = getFocusParam(method);
 	if (src.empty())
 		src = std::vector<cv::UMat>(range.n());
-	cv::UMat slice(rect.size(), param->type);
 	std::map<int,double> scores;
+	auto slice = [&](int i) {
+		if (src[i].empty())
+			recon(src[i], range.z(i), param->output);
+		return cv::UMat(src[i], rect);
+	};
+	auto prefetch = [&](const std::vector<int>& idx) {
+		scorePlanes(*m_backend, scores, idx, param, slice);
+	};
 	auto f = [&](double x) {
 		int i = round(x);
-		auto it = scores.find(i);
-		if (it != scores.end()) {
-			return it->second;
-		}
-		else {
-			if (src[i].empty())
-				recon(src[i], range.z(i), param->output);
-			cv::UMat(src[i], rect).convertTo(slice, param->type);
-			double newScore = param->scoreFunc(slice);
-			scores[i] = newScore;
-			return newScore;
-		}
+		scorePlanes(*m_backend, scores, {i}, param, slice);
+		return scores[i];
 	};
-	idx = SSearch(f, 0, range.n()-1, step);
+	idx = SSearch(f, 0, range.n()-1, step, prefetch);
 	score = f(idx);
+	if (frac) {
+		*frac = 0.0;
+		if (idx > 0 && idx < range.n()-1) {
+			prefetch({idx-1, idx+1});
+			*frac = peakOffset(scores[idx-1], score, scores[idx+1]);
+		}
+		return range.interp(idx + *frac);
+	}
 	return range.z(idx);
 }
 
+void Hologram::addFilter(float f, FilterType type)
+{
+	m_filters.emplace_back(f, type);
+	if (!m_sizePad.empty()) {
+		fillFilter();
+		fillCache();
+	}
+}
+
+void Hologram::clearFilters()
+{
+	m_filters.clear();
+	if (!m_sizePad.empty()) {
+		fillFilter();
+		fillCache();
+	}
+}
+
 void Hologram::applyFilter(const cv::UMat& H)
 {
-	mulSpectrums(m_dft, H, m_dft, 0);
+	cv::UMat dft = m_dft;
+	if (m_fp16)
+		m_dft.convertTo(dft, CV_32F);
+	if (H.type() == CV_32FC1)
+		cv::multiply(dft, H, dft);
+	else
+		mulSpectrums(dft, H, dft, 0);
+	if (m_fp16)
+		dft.convertTo(m_dft, CV_16F);
 }
 
 cv::UMat Hologram::createFilter(float f, FilterType type) const
 {
 	CV_Assert(!m_sizePad.empty());
-	float sigma = f * pow(log(1.0/pow(FILTER_F, 2)), -1.0/(2.0*FILTER_N));
+	float sigma = filterSigma(f);
 	cv::UMat H(m_sizePad, CV_32FC2);
-	size_t gsize[2] = {(size_t)m_sizePad.width, (size_t)m_sizePad.height};
-	cv::ocl::Kernel("supergaussian", icemet_hologram_ocl()).args(
-		cv::ocl::KernelArg::WriteOnly(H),
-		cv::Vec2f(m_psz*m_sizePad.width, m_psz*m_sizePad.height),
-		type,
-		cv::Vec2f(sigma, sigma),
-		FILTER_N
-	).run(2, gsize, NULL, true);
+	cv::Vec2f size(m_psz*m_sizePad.width, m_psz*m_sizePad.height);
+	m_backend->supergaussian(H, size, type, cv::Vec2f(sigma, sigma), FILTER_N);
+	
+	// Real filters are applied directly to the packed spectrum
+	if (m_half) {
+		cv::UMat Hccs;
+		expandCCS(H, Hccs, 0);
+		return Hccs;
+	}
 	return H;
 }
 
@@ -337,32 +1795,153 @@ cv::UMat Hologram::createHPF(float f) const
 	return createFilter(f, FILTER_HIGHPASS);
 }
 
+void Hologram::setKernelOptions(const std::string& opts)
+{
+	initKernels();
+	buildKernels(opts);
+}
+
+std::string Hologram::kernelOptions()
+{
+	initKernels();
+	return kernelOpts;
+}
+
 float Hologram::magnf(float dist, float z)
 {
 	return dist == 0.0 ? 1.0 : dist / (dist - z);
 }
 
+size_t Hologram::maxStackSize()
+{
+	// Plane offsets are passed to the kernels and used in their address arithmetic as int
+	return std::min((size_t)std::numeric_limits<int>::max(), HologramBackend::create()->maxAlloc());
+}
+
 void Hologram::focus(std::vector<cv::UMat>& src, const cv::Rect& rect, int &idx, double &score, FocusMethod method, int begin, int end, double step)
 {
 	int sz = src.size();
 	end = end < 0 || end > sz-1 ? sz-1 : end;
 	
+	cv::Ptr<HologramBackend> backend = HologramBackend::create();
 	const FocusParam* param = getFocusParam(method);
-	cv::UMat slice(rect.height, rect.width, param->type);
 	std::map<int,double> scores;
+	auto slice = [&](int i) {
+		return cv::UMat(src[i], rect);
+	};
+	auto prefetch = [&](const std::vector<int>& idx) {
+		scorePlanes(*backend, scores, idx, param, slice);
+	};
 	auto f = [&](double x) {
 		int i = round(x);
-		auto it = scores.find(i);
-		if (it != scores.end()) {
-			return it->second;
-		}
-		else {
-			cv::UMat(src[i], rect).convertTo(slice, param->type);
-			double newScore = param->scoreFunc(slice);
-			scores[i] = newScore;
-			return newScore;
-		}
+		scorePlanes(*backend, scores, {i}, param, slice);
+		return scores[i];
 	};
-	idx = SSearch(f, begin, end, step);
+	idx = SSearch(f, begin, end, step, prefetch);
 	score = f(idx);
 }
+
+void Hologram::focus(std::vector<cv::UMat>& src, const std::vector<cv::Rect>& rects, const std::vector<FocusMethod>& methods, std::vector<int>& idx, std::vector<double>& score, int begin, int end, double step, std::vector<double>* frac)
+{
+	int sz = src.size();
+	end = end < 0 || end > sz-1 ? sz-1 : end;
+	
+	cv::Ptr<HologramBackend> backend = HologramBackend::create();
+	int n = rects.size();
+	std::vector<const FocusParam*> params;
+	std::vector<StepSearch> searches;
+	for (int r = 0; r < n; r++) {
+		params.push_back(getFocusParam(methods[r]));
+		searches.emplace_back(begin, end, step);
+	}
+	std::vector<std::map<int,double>> scores(n);
+	
+	// Probes of the ROIs that don't have a score for plane i yet
+	std::vector<std::pair<int,int>> probes;
+	auto addProbe = [&](int r, int i) {
+		if (scores[r].find(i) == scores[r].end()) {
+			scores[r][i] = 0.0;
+			probes.emplace_back(r, i);
+		}
+	};
+	
+	// Advance all searches together, each round is scored at once
+	while (true) {
+		probes.clear();
+		bool done = true;
+		for (int r = 0; r < n; r++) {
+			if (searches[r].done())
+				continue;
+			done = false;
+			std::vector<int> pts;
+			searches[r].points(pts);
+			for (int i : pts)
+				addProbe(r, i);
+		}
+		if (done)
+			break;
+		scoreProbes(*backend, src, rects, params, probes, scores);
+		for (int r = 0; r < n; r++) {
+			if (!searches[r].done())
+				searches[r].advance([&](double x) { return scores[r][round(x)]; });
+		}
+	}
+	
+	idx.resize(n);
+	score.resize(n);
+	probes.clear();
+	for (int r = 0; r < n; r++) {
+		idx[r] = searches[r].result();
+		addProbe(r, idx[r]);
+		if (frac && idx[r] > begin && idx[r] < end) {
+			addProbe(r, idx[r]-1);
+			addProbe(r, idx[r]+1);
+		}
+	}
+	scoreProbes(*backend, src, rects, params, probes, scores);
+	for (int r = 0; r < n; r++)
+		score[r] = scores[r][idx[r]];
+	
+	if (frac) {
+		frac->assign(n, 0.0);
+		for (int r = 0; r < n; r++) {
+			if (idx[r] > begin && idx[r] < end)
+				(*frac)[r] = peakOffset(scores[r][idx[r]-1], score[r], scores[r][idx[r]+1]);
+		}
+	}
+}
+
+void Hologram::focusTiles(const cv::Mat& tiles, const cv::Size2i& size, const std::vector<cv::Rect>& rects, std::vector<int>& idx, std::vector<double>& score, std::vector<double>* frac)
+{
+	const int tilesX = (size.width + TILE-1) / TILE;
+	const int n = tiles.rows;
+	const int nr = rects.size();
+	idx.assign(nr, 0);
+	score.assign(nr, 0.0);
+	if (frac)
+		frac->assign(nr, 0.0);
+	
+	// The score of a plane is the mean variance of the tiles the ROI touches
+	std::vector<double> scores(n);
+	for (int r = 0; r < nr; r++) {
+		const cv::Rect& rect = rects[r];
+		int tx0 = rect.x / TILE;
+		int ty0 = rect.y / TILE;
+		int tx1 = (rect.x + rect.width - 1) / TILE;
+		int ty1 = (rect.y + rect.height - 1) / TILE;
+		for (int k = 0; k < n; k++) {
+			const float* t = tiles.ptr<float>(k);
+			double sum = 0.0;
+			for (int ty = ty0; ty <= ty1; ty++) {
+				for (int tx = tx0; tx <= tx1; tx++)
+					sum += t[ty*tilesX + tx];
+			}
+			scores[k] = sum / ((tx1-tx0+1) * (ty1-ty0+1));
+		}
+		
+		idx[r] = std::max_element(scores.begin(), scores.end()) - scores.begin();
+		score[r] = scores[idx[r]];
+		if (frac && idx[r] > 0 && idx[r] < n-1)
+			(*frac)[r] = peakOffset(scores[idx[r]-1], score[r], scores[idx[r]+1]);
+	}
+}
@@ -3,6 +3,9 @@
 
 #include <opencv2/core.hpp>
 
+#include <map>
+#include <string>
+#include <utility>
 #include <vector>
 
 typedef enum _recon_output {
@@ -34,14 +37,22 @@ public:
 	ZRange(float z0, float z1, float dz0, float dz1);
 	
 	void setParam(float z0, float z1, float dz0, float dz1);
+	ZRange slice(int i0, int i1) const;
+	ZRange sample(int step) const;
 	
 	int n() const;
 	float z(int i) const;
+	float interp(double i) const;
 	float dz(int i) const;
 };
 
+class HologramBackend;
+
 class Hologram {
 private:
+	// CPU or OpenCL implementation, chosen when the hologram is created
+	cv::Ptr<HologramBackend> m_backend;
+	
 	cv::Size2i m_sizeOrig;
 	cv::Size2i m_sizePad;
 	
@@ -52,29 +63,99 @@ private:
 	cv::UMat m_prop;
 	cv::UMat m_dft;
 	cv::UMat m_complex;
+	cv::UMat m_input;
+	
+	bool m_half;
+	bool m_fp16;
+	cv::UMat m_propCCS;
+	
+	size_t m_mem;
+	int m_step;
+	int m_stepSize;
+	
+	int m_batch;
+	int m_batchSize;
+	cv::UMat m_batchComplex;
+	
+	ZRange m_cacheRange;
+	size_t m_cacheMax;
+	cv::UMat m_cache;
+	std::map<float,int> m_cacheIdx;
+	
+	std::vector<std::pair<float,FilterType>> m_filters;
+	cv::UMat m_filter;
 	
 	void propagate(float z);
+	cv::Vec3i propagateBatch(const ZRange& range, int i0, int n, cv::UMat& batch);
+	void expandCCS(const cv::UMat& src, cv::UMat& dst, int part) const;
+	void allocBatch();
+	void allocStep();
+	void fillCache();
+	void fillFilter();
+	int cacheIdx(float z) const;
+	int spectrumType() const;
+	void reconMinBatch(std::vector<cv::UMat>* dst, cv::UMat& dstMin, const ZRange& range, ReconOutput output, cv::UMat* tiles);
 
 public:
 	Hologram(float psz, float lambda, float dist=0.0);
 	
+	size_t memory() const;
+	void setMemory(size_t mem) { m_mem = mem; }
+	
+	int step() const { return m_stepSize; }
+	void setStep(int step);
+	
+	int batch() const { return m_batchSize; }
+	void setBatch(int batch);
+	
+	bool halfSpectrum() const { return m_half; }
+	void setHalfSpectrum(bool half);
+	
+	// Store the spectrum and the cached transfer functions in half precision (OpenCL only)
+	bool fp16Storage() const { return m_fp16; }
+	void setFp16Storage(bool fp16);
+	
+	int cached() const { return m_cacheIdx.size(); }
+	size_t cacheSize() const { return m_cache.total() * m_cache.elemSize(); }
+	void setCache(const ZRange& range, size_t maxSize);
+	
+	cv::Size2i size() const { return m_sizeOrig; }
+	void setSize(const cv::Size2i& size);
 	void setImg(const cv::UMat& img);
+	// Image area of the padded FFT input, for writing the image directly.
+	// setInput() pads it with the image mean and transforms it like setImg().
+	cv::UMat input();
+	void setInput(double mean);
+	void setSpectrum(const cv::UMat& spectrum, const cv::Size2i& size);
+	void takeSpectrum(cv::UMat& dst);
 	void recon(cv::UMat& dst, float z, ReconOutput output=RECON_OUTPUT_AMPLITUDE);
 	
 	void min(cv::UMat& dst, const ZRange& range, ReconOutput output=RECON_OUTPUT_AMPLITUDE);
-	void reconMin(std::vector<cv::UMat>& dst, cv::UMat& dstMin, const ZRange& range, ReconOutput output=RECON_OUTPUT_AMPLITUDE);
+	void reconMin(std::vector<cv::UMat>& dst, cv::UMat& dstMin, const ZRange& range, ReconOutput output=RECON_OUTPUT_AMPLITUDE, cv::UMat* tiles=NULL);
+	void tune(float z);
 	
 	float focus(const ZRange& range, FocusMethod method=FOCUS_STD, double step=1.0);
-	float focus(const ZRange& range, std::vector<cv::UMat>& src, const cv::Rect& rect, int &idx, double &score, FocusMethod method=FOCUS_STD, double step=1.0);
+	float focus(const ZRange& range, std::vector<cv::UMat>& src, const cv::Rect& rect, int &idx, double &score, FocusMethod method=FOCUS_STD, double step=1.0, double* frac=NULL);
 	
+	void addFilter(float f, FilterType type);
+	void clearFilters();
 	void applyFilter(const cv::UMat& H);
 	cv::UMat createFilter(float f, FilterType type) const;
 	cv::UMat createLPF(float f) const;
 	cv::UMat createHPF(float f) const;
 	
+	// Build options of the OpenCL kernels (-D PIXEL_VEC4, -D FOCUS_TILED), chosen for the device by default.
+	// Must not be changed while other threads are reconstructing.
+	static void setKernelOptions(const std::string& opts);
+	static std::string kernelOptions();
+	
 	static float magnf(float dist, float z);
+	// Largest plane stack kept in one buffer, the kernels address it with int byte offsets
+	static size_t maxStackSize();
 	
 	static void focus(std::vector<cv::UMat>& src, const cv::Rect& rect, int &idx, double &score, FocusMethod method=FOCUS_STD, int begin=0, int end=-1, double step=1.0);
+	static void focusTiles(const cv::Mat& tiles, const cv::Size2i& size, const std::vector<cv::Rect>& rects, std::vector<int>& idx, std::vector<double>& score, std::vector<double>* frac=NULL);
+	static void focus(std::vector<cv::UMat>& src, const std::vector<cv::Rect>& rects, const std::vector<FocusMethod>& methods, std::vector<int>& idx, std::vector<double>& score, int begin=0, int end=-1, double step=1.0, std::vector<double>* frac=NULL);
 };
 typedef cv::Ptr<Hologram> HologramPtr;
 
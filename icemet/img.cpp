@@ -1,13 +1,23 @@
 #include "img.hpp"
 
+#include "icemet/util/strfmt.hpp"
 #include "opencl/icemet_bgsub_ocl.hpp"
+#include "opencl/icemet_crop_ocl.hpp"
 
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/utility.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
 
 #define BGSUBSTACK_LEN_MAX 25
+#define CROP_LOCAL 256 // Must match icemet_crop.cl
+
+Image::Image() : File() {}
 
 Image::Image(const std::string& name) : File(name) {}
 
@@ -20,34 +30,348 @@ Image::Image(const fs::path& p) : File(p)
 	mat.getUMat(cv::ACCESS_READ).copyTo(original);
 }
 
-BGSubStack::BGSubStack(size_t len) :
+static cv::ocl::Kernel cropKernel()
+{
+	static const OCLKernels kernels(icemet_crop_ocl());
+	return kernels("crop");
+}
+
+Crop::Crop(const cv::Rect& rect, double angle) :
+	m_rect(rect),
+	m_rotate(angle != 0.0)
+{
+	if (m_rotate) {
+		// Source position of every pixel rotated around the center of the rectangle,
+		// in the integer and fractional tables of cv::convertMaps()
+		cv::Point2f center(rect.width/2.0, rect.height/2.0);
+		cv::Matx23d inv;
+		cv::invertAffineTransform(cv::getRotationMatrix2D(center, angle, 1.0), inv);
+		cv::Mat mapX(rect.size(), CV_32FC1);
+		cv::Mat mapY(rect.size(), CV_32FC1);
+		for (int y = 0; y < rect.height; y++) {
+			for (int x = 0; x < rect.width; x++) {
+				mapX.at<float>(y, x) = inv(0, 0)*x + inv(0, 1)*y + inv(0, 2);
+				mapY.at<float>(y, x) = inv(1, 0)*x + inv(1, 1)*y + inv(1, 2);
+			}
+		}
+		cv::Mat map, frac;
+		cv::convertMaps(mapX, mapY, map, frac, CV_16SC2);
+		map.copyTo(m_map);
+		frac.copyTo(m_frac);
+	}
+	m_sums = cv::UMat(1, (rect.area() + CROP_LOCAL-1) / CROP_LOCAL, CV_32SC1);
+}
+
+double Crop::apply(const cv::UMat& src, cv::UMat& dst, cv::UMat* fdst)
+{
+	CV_Assert(src.type() == CV_8UC1);
+	CV_Assert((m_rect & cv::Rect(cv::Point(), src.size())) == m_rect);
+	if (dst.empty())
+		dst = cv::UMat(m_rect.size(), CV_8UC1);
+	CV_Assert(dst.size() == m_rect.size() && (!fdst || fdst->size() == m_rect.size()));
+	
+	if (cv::ocl::useOpenCL()) {
+		size_t gsize[1] = {(size_t)m_sums.cols*CROP_LOCAL};
+		size_t lsize[1] = {CROP_LOCAL};
+		cropKernel().args(
+			cv::ocl::KernelArg::ReadOnly(src),
+			cv::ocl::KernelArg::WriteOnlyNoSize(dst),
+			cv::ocl::KernelArg::WriteOnlyNoSize(fdst ? *fdst : dst), // Unused without fdst
+			(int)(fdst != NULL),
+			cv::ocl::KernelArg::PtrReadOnly(m_rotate ? m_map : m_sums), // Unused without rotation
+			cv::ocl::KernelArg::PtrReadOnly(m_rotate ? m_frac : m_sums),
+			(int)m_rotate,
+			cv::ocl::KernelArg::PtrWriteOnly(m_sums),
+			m_rect.x, m_rect.y, m_rect.width, m_rect.height
+		).run(1, gsize, lsize, false);
+		return cv::sum(m_sums)[0] / m_rect.area();
+	}
+	
+	// CPU backend, strips of rows are cropped and summed while they are in the cache
+	cv::Mat in = src.getMat(cv::ACCESS_READ)(m_rect);
+	cv::Mat out = dst.getMat(cv::ACCESS_WRITE);
+	cv::Mat fout = fdst ? fdst->getMat(cv::ACCESS_WRITE) : cv::Mat();
+	cv::Mat map = m_rotate ? m_map.getMat(cv::ACCESS_READ) : cv::Mat();
+	cv::Mat frac = m_rotate ? m_frac.getMat(cv::ACCESS_READ) : cv::Mat();
+	std::vector<double> sums(m_rect.height);
+	cv::parallel_for_(cv::Range(0, m_rect.height), [&](const cv::Range& r) {
+		cv::Mat strip = out.rowRange(r.start, r.end);
+		if (m_rotate)
+			cv::remap(in, strip, map.rowRange(r.start, r.end), frac.rowRange(r.start, r.end), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
+		else
+			in.rowRange(r.start, r.end).copyTo(strip);
+		if (fdst)
+			strip.convertTo(fout.rowRange(r.start, r.end), CV_32FC1);
+		sums[r.start] = cv::sum(strip)[0];
+	});
+	double sum = 0.0;
+	for (double val : sums)
+		sum += val;
+	return sum / m_rect.area();
+}
+
+static std::vector<std::pair<int,int>> medianNetwork(int n)
+{
+	// Batcher's odd-even merge sort, same as median_network() in icemet_bgsub.cl
+	std::vector<std::pair<int,int>> net;
+	for (int p = 1; p < n; p *= 2) {
+		for (int k = p; k > 0; k /= 2) {
+			for (int j = k % p; j+k < n; j += 2*k) {
+				for (int i = 0; i < k && i+j+k < n; i++) {
+					if ((i+j) / (2*p) == (i+j+k) / (2*p))
+						net.emplace_back(i+j, i+j+k);
+				}
+			}
+		}
+	}
+	
+	// Only the pairs that reach the median are needed
+	std::vector<bool> needed(n, false);
+	needed[n/2] = true;
+	std::vector<std::pair<int,int>> pruned;
+	for (auto it = net.rbegin(); it != net.rend(); it++) {
+		if (needed[it->first] || needed[it->second]) {
+			needed[it->first] = needed[it->second] = true;
+			pruned.push_back(*it);
+		}
+	}
+	std::reverse(pruned.begin(), pruned.end());
+	return pruned;
+}
+
+BGSubStack::BGSubStack(size_t len, bool network) :
 	m_len(len),
 	m_idx(0),
 	m_full(false),
+	m_network(network),
 	m_images(len)
 {
 	if (len < 3 || len > BGSUBSTACK_LEN_MAX || len%2 == 0)
 		throw(std::invalid_argument("Invalid BGSubStack length"));
+	if (m_network)
+		m_net = medianNetwork(len);
+	if (cv::ocl::useOpenCL()) {
+		std::string opts = m_network ? strfmt("-D STACK_LEN={}", len) : std::string();
+		m_kernels = OCLKernels(icemet_bgsub_ocl(opts), opts);
+	}
 }
 
-bool BGSubStack::push(const ImgPtr& img)
+static inline float normalise(uchar px, float mean)
+{
+	return (float)px / std::max(1.f, mean);
+}
+
+static void pushCPU(cv::Mat& stack, const cv::Mat& means, cv::Mat& order, cv::Mat& rank, int size, int idx, int count)
+{
+	// Same as the push kernel
+	uchar* S = stack.ptr<uchar>();
+	const float* M = means.ptr<float>();
+	uchar* O = order.ptr<uchar>();
+	uchar* R = rank.ptr<uchar>();
+	cv::parallel_for_(cv::Range(0, size), [&](const cv::Range& rng) {
+		for (int gid = rng.start; gid < rng.end; gid++) {
+			float val = normalise(S[idx*size + gid], M[idx]);
+			int old = idx < count ? R[idx*size + gid] : count;
+			int n = idx < count ? count-1 : count;
+			
+			int low = 0;
+			int high = n;
+			while (low < high) {
+				int middle = (low + high) / 2;
+				uchar k = O[(middle < old ? middle : middle+1)*size + gid];
+				if (normalise(S[k*size + gid], M[k]) < val)
+					low = middle + 1;
+				else
+					high = middle;
+			}
+			
+			for (int r = old; r > low; r--) {
+				uchar k = O[(r-1)*size + gid];
+				O[r*size + gid] = k;
+				R[k*size + gid] = r;
+			}
+			for (int r = old; r < low; r++) {
+				uchar k = O[(r+1)*size + gid];
+				O[r*size + gid] = k;
+				R[k*size + gid] = r;
+			}
+			O[low*size + gid] = idx;
+			R[idx*size + gid] = low;
+		}
+	});
+}
+
+static void meddivCPU(const cv::Mat& stack, const cv::Mat& means, const cv::Mat& order, cv::Mat& dst, int size, int len, int idx)
+{
+	const uchar* S = stack.ptr<uchar>();
+	const float* M = means.ptr<float>();
+	const uchar* R = order.ptr<uchar>();
+	uchar* D = dst.ptr<uchar>();
+	cv::parallel_for_(cv::Range(0, size), [&](const cv::Range& r) {
+		for (int gid = r.start; gid < r.end; gid++) {
+			// Median from the sorted slots
+			int med = R[len/2*size + gid];
+			uchar A = std::min(std::max(normalise(S[idx*size + gid], M[idx]) * M[idx], 0.f), 255.f);
+			uchar B = std::min(std::max(normalise(S[med*size + gid], M[med]) * M[idx], 0.f), 255.f);
+			
+			// Division
+			float val = (float)A / std::max(1.f, (float)B) * M[idx];
+			D[gid] = std::min(std::max(val, 0.f), 255.f);
+		}
+	});
+}
+
+static inline uchar scaleCPU(float val)
+{
+	return std::min(std::max(val, 0.f), 255.f);
+}
+
+#if CV_SIMD128
+static inline void expand16(const cv::v_uint8x16& v, cv::v_float32x4* f)
+{
+	cv::v_uint16x8 w0, w1;
+	cv::v_uint32x4 u[4];
+	cv::v_expand(v, w0, w1);
+	cv::v_expand(w0, u[0], u[1]);
+	cv::v_expand(w1, u[2], u[3]);
+	for (int i = 0; i < 4; i++)
+		f[i] = cv::v_cvt_f32(cv::v_reinterpret_as_s32(u[i]));
+}
+
+static inline cv::v_uint8x16 pack16(const cv::v_float32x4* f)
+{
+	// Clamp and truncate like scaleCPU()
+	cv::v_int32x4 r[4];
+	for (int i = 0; i < 4; i++)
+		r[i] = cv::v_trunc(cv::v_min(cv::v_max(f[i], cv::v_setzero_f32()), cv::v_setall_f32(255.f)));
+	return cv::v_pack_u(cv::v_pack(r[0], r[1]), cv::v_pack(r[2], r[3]));
+}
+#endif
+
+static void meddivNetworkCPU(const cv::Mat& stack, const cv::Mat& means, cv::Mat& dst, int size, int len, int idx, const std::vector<std::pair<int,int>>& net)
 {
-	if (m_stack.empty()) {
-		m_size = img->preproc.size();
-		m_stack = cv::UMat(1, m_len * m_size.width * m_size.height, CV_8UC1);
-		m_means = cv::Mat(1, m_len, CV_32FC1);
+	// Same as the meddiv_network kernel, 16 pixels at a time with SIMD
+	const uchar* S = stack.ptr<uchar>();
+	const float* M = means.ptr<float>();
+	uchar* D = dst.ptr<uchar>();
+	cv::parallel_for_(cv::Range(0, size), [&](const cv::Range& r) {
+		int gid = r.start;
+#if CV_SIMD128
+		cv::v_uint8x16 A[BGSUBSTACK_LEN_MAX];
+		cv::v_float32x4 f[4], g[4];
+		const cv::v_float32x4 one = cv::v_setall_f32(1.f);
+		const cv::v_float32x4 mean = cv::v_setall_f32(M[idx]);
+		for (; gid + 16 <= r.end; gid += 16) {
+			// Fill median array
+			for (int i = 0; i < len; i++) {
+				expand16(cv::v_load(S + i*size + gid), f);
+				const cv::v_float32x4 div = cv::v_setall_f32(std::max(1.f, M[i]));
+				for (int j = 0; j < 4; j++)
+					f[j] = f[j] / div * mean;
+				A[i] = pack16(f);
+			}
+			cv::v_uint8x16 B = A[idx];
+			for (const auto& p : net) {
+				cv::v_uint8x16 a = A[p.first];
+				A[p.first] = cv::v_min(a, A[p.second]);
+				A[p.second] = cv::v_max(a, A[p.second]);
+			}
+			
+			// Division
+			expand16(B, f);
+			expand16(A[len/2], g);
+			for (int j = 0; j < 4; j++)
+				f[j] = f[j] / cv::v_max(one, g[j]) * mean;
+			cv::v_store(D + gid, pack16(f));
+		}
+#endif
+		uchar a[BGSUBSTACK_LEN_MAX];
+		for (; gid < r.end; gid++) {
+			for (int i = 0; i < len; i++)
+				a[i] = scaleCPU((float)S[i*size + gid] / std::max(1.f, M[i]) * M[idx]);
+			uchar b = a[idx];
+			for (const auto& p : net) {
+				uchar tmp = a[p.first];
+				a[p.first] = std::min(tmp, a[p.second]);
+				a[p.second] = std::max(tmp, a[p.second]);
+			}
+			D[gid] = scaleCPU((float)b / std::max(1.f, (float)a[len/2]) * M[idx]);
+		}
+	});
+}
+
+void BGSubStack::setSize(const cv::Size2i& size)
+{
+	m_size = size;
+	m_stack = cv::UMat(1, m_len * m_size.width * m_size.height, CV_8UC1);
+	if (!m_network) {
+		m_order = cv::UMat(1, m_len * m_size.width * m_size.height, CV_8UC1);
+		m_rank = cv::UMat(1, m_len * m_size.width * m_size.height, CV_8UC1);
 	}
+	m_means = cv::Mat(1, m_len, CV_32FC1);
+	m_meansDev = cv::UMat(1, m_len, CV_32FC1);
+}
+
+cv::UMat BGSubStack::slot(int idx)
+{
+	// One image of the stack as a continuous view
+	int size = m_size.width * m_size.height;
+	return cv::UMat(m_stack, cv::Rect(idx*size, 0, size, 1)).reshape(1, m_size.height);
+}
+
+bool BGSubStack::push(const ImgPtr& img)
+{
+	if (m_stack.empty())
+		setSize(img->preproc.size());
+	
+	cv::UMat dst = slot(m_idx);
+	img->preproc.copyTo(dst);
+	img->preproc = dst;
+	return pushSlot(img, cv::mean(dst)[0]);
+}
+
+bool BGSubStack::push(const ImgPtr& img, const cv::UMat& src, Crop& crop)
+{
+	if (m_stack.empty())
+		setSize(crop.size());
+	CV_Assert(crop.size() == m_size);
 	
+	cv::UMat dst = slot(m_idx);
+	double mean = crop.apply(src, dst);
+	img->preproc = dst;
+	return pushSlot(img, mean);
+}
+
+bool BGSubStack::pushSlot(const ImgPtr& img, double mean)
+{
+	// Without the sorting network the slots of every pixel are sorted when the image is
+	// stored. The old rank is looked up and the new one found with O(log len) reads, then
+	// only the ranks in between are moved, instead of a selection over all len samples.
 	int idx = m_idx;
-	size_t gsize[1] = {(size_t)(m_size.width * m_size.height)};
-	cv::ocl::Kernel("push", icemet_bgsub_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(img->preproc),
-		cv::ocl::KernelArg::PtrWriteOnly(m_stack),
-		m_size.width * m_size.height, idx
-	).run(1, gsize, NULL, true);
+	int size = m_size.width * m_size.height;
+	int count = m_full ? m_len : m_idx;
+	m_means.at<float>(0, m_idx) = mean;
+	if (cv::ocl::useOpenCL()) {
+		// Keep a device copy, the host means change while the kernels may still be running
+		m_means.copyTo(m_meansDev);
+		if (!m_network) {
+			size_t gsize[1] = {(size_t)size};
+			m_kernels("push").args(
+				cv::ocl::KernelArg::PtrReadWrite(m_stack),
+				cv::ocl::KernelArg::PtrReadOnly(m_meansDev),
+				cv::ocl::KernelArg::PtrReadWrite(m_order),
+				cv::ocl::KernelArg::PtrReadWrite(m_rank),
+				size, idx, count
+			).run(1, gsize, NULL, false);
+		}
+	}
+	else if (!m_network) {
+		cv::Mat stack = m_stack.getMat(cv::ACCESS_RW);
+		cv::Mat order = m_order.getMat(cv::ACCESS_RW);
+		cv::Mat rank = m_rank.getMat(cv::ACCESS_RW);
+		pushCPU(stack, m_means, order, rank, size, idx, count);
+	}
 	
-	cv::Scalar imgMean = cv::mean(img->preproc);
-	m_means.at<float>(0, m_idx) = imgMean[0];
 	m_images[m_idx] = img;
 	
 	// Increment index
@@ -66,12 +390,37 @@ ImgPtr BGSubStack::meddiv()
 {
 	int idx = (m_idx + m_len/2) % m_len;
 	int len = m_len;
-	size_t gsize[1] = {(size_t)(m_size.width * m_size.height)};
-	cv::ocl::Kernel("meddiv", icemet_bgsub_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(m_stack),
-		cv::ocl::KernelArg::PtrReadOnly(m_means.getUMat(cv::ACCESS_READ)),
-		cv::ocl::KernelArg::PtrWriteOnly(m_images[idx]->preproc),
-		m_size.width * m_size.height, len, idx
-	).run(1, gsize, NULL, true);
+	int size = m_size.width * m_size.height;
+	
+	// The image stays in the stack, the result gets its own buffer.
+	// The device means were updated by push().
+	m_images[idx]->preproc = cv::UMat(m_size, CV_8UC1);
+	if (m_network && cv::ocl::useOpenCL()) {
+		size_t gsize[1] = {(size_t)size};
+		m_kernels("meddiv_network").args(
+			cv::ocl::KernelArg::PtrReadOnly(m_stack),
+			cv::ocl::KernelArg::PtrReadOnly(m_meansDev),
+			cv::ocl::KernelArg::PtrWriteOnly(m_images[idx]->preproc),
+			size, idx
+		).run(1, gsize, NULL, false);
+	}
+	else if (m_network) {
+		cv::Mat dst = m_images[idx]->preproc.getMat(cv::ACCESS_WRITE);
+		meddivNetworkCPU(m_stack.getMat(cv::ACCESS_READ), m_means, dst, size, len, idx, m_net);
+	}
+	else if (cv::ocl::useOpenCL()) {
+		size_t gsize[1] = {(size_t)size};
+		m_kernels("meddiv").args(
+			cv::ocl::KernelArg::PtrReadOnly(m_stack),
+			cv::ocl::KernelArg::PtrReadOnly(m_meansDev),
+			cv::ocl::KernelArg::PtrReadOnly(m_order),
+			cv::ocl::KernelArg::PtrWriteOnly(m_images[idx]->preproc),
+			size, len, idx
+		).run(1, gsize, NULL, false);
+	}
+	else {
+		cv::Mat dst = m_images[idx]->preproc.getMat(cv::ACCESS_WRITE);
+		meddivCPU(m_stack.getMat(cv::ACCESS_READ), m_means, m_order.getMat(cv::ACCESS_READ), dst, size, len, idx);
+	}
 	return m_images[idx];
 }
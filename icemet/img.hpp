@@ -3,10 +3,12 @@
 
 #include "icemet/file.hpp"
 #include "icemet/hologram.hpp"
+#include "icemet/util/ocl.hpp"
 
 #include <opencv2/core.hpp>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 typedef struct _segment {
@@ -73,27 +75,65 @@ public:
 	cv::UMat original;
 	cv::UMat preproc;
 	cv::UMat min;
+	cv::UMat spectrum; // Hologram spectrum from the empty checks
+	cv::UMat coarseMin; // Amplitude minimum over every 10th frame
 	std::vector<SegmentPtr> segments;
 	std::vector<ParticlePtr> particles;
 };
 typedef cv::Ptr<Image> ImgPtr;
 
+class Crop {
+private:
+	cv::Rect m_rect;
+	bool m_rotate;
+	cv::UMat m_map;
+	cv::UMat m_frac;
+	cv::UMat m_sums;
+
+public:
+	// Fixed crop rectangle, rotated by angle degrees around its center with a precomputed remap table
+	Crop(const cv::Rect& rect, double angle=0.0);
+	
+	cv::Size2i size() const { return m_rect.size(); }
+	
+	// Crops src to dst and returns the mean. With fdst the result is also written as float,
+	// e.g. to Hologram::input().
+	double apply(const cv::UMat& src, cv::UMat& dst, cv::UMat* fdst=NULL);
+};
+typedef cv::Ptr<Crop> CropPtr;
+
 class BGSubStack {
 private:
 	size_t m_len;
 	cv::Size2i m_size;
 	size_t m_idx;
 	bool m_full;
+	bool m_network;
 	std::vector<ImgPtr> m_images;
 	cv::UMat m_stack;
+	cv::UMat m_order; // Slots of every pixel sorted by the normalised value, len planes
+	cv::UMat m_rank; // Inverse of m_order, the rank of every slot, len planes
 	cv::Mat m_means;
+	cv::UMat m_meansDev;
+	OCLKernels m_kernels;
+	std::vector<std::pair<int,int>> m_net;
+	
+	cv::UMat slot(int idx);
+	bool pushSlot(const ImgPtr& img, double mean);
 
 public:
-	BGSubStack(size_t len);
+	// The median is found from per pixel sorted slots, or with a sorting network built for len
+	BGSubStack(size_t len, bool network=false);
 	
 	size_t len() { return m_len; }
+	bool network() { return m_network; }
+	void setSize(const cv::Size2i& size);
 	
+	// Copies the preprocessed image to the stack
 	bool push(const ImgPtr& img);
+	// Crops src straight to the stack and takes the mean in the same pass.
+	// The preprocessed image becomes a view of the stack until meddiv().
+	bool push(const ImgPtr& img, const cv::UMat& src, Crop& crop);
 	ImgPtr get(size_t idx);
 	ImgPtr meddiv();
 };
@@ -3,11 +3,23 @@
 #include "opencl/icemet_math_ocl.hpp"
 
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/utility.hpp>
 
+#include <algorithm>
 #include <cmath>
+#include <mutex>
+
+#define HIST_LOCAL 256 // Must match icemet_math.cl
+#define HIST_GROUPS_PER_CU 4
 
 const double Math::pi = 3.14159265358979323846;
 
+static cv::ocl::Kernel kernel(const char* name)
+{
+	static const OCLKernels kernels(icemet_math_ocl());
+	return kernels(name);
+}
+
 double Math::equivdiam(double area)
 {
 	return sqrt(4*area/pi);
@@ -23,14 +35,27 @@ double Math::Vcone(double h, double A1, double A2)
 	return h * (A1 + sqrt(A1*A2) + A2) / 3.0;
 }
 
-int Math::median(cv::UMat img)
+int Math::median(cv::UMat img, int* minVal, int* maxVal)
 {
 	cv::Mat hist;
 	Math::hist(img, hist);
+	const int* H = hist.ptr<int>();
 	int sum = 0;
 	int i = 0;
 	while (sum < img.cols * img.rows / 2)
-		sum += hist.at<int>(0, i++);
+		sum += H[i++];
+	
+	// The extremes are the first and the last non-empty bin
+	if (minVal) {
+		*minVal = 0;
+		while (*minVal < 255 && !H[*minVal])
+			(*minVal)++;
+	}
+	if (maxVal) {
+		*maxVal = 255;
+		while (*maxVal > 0 && !H[*maxVal])
+			(*maxVal)--;
+	}
 	return i-1;
 }
 
@@ -56,21 +81,60 @@ void Math::adjust(const cv::UMat& src, cv::UMat& dst, uchar a0, uchar a1, uchar
 	if (dst.empty())
 		dst = cv::UMat(src.size(), CV_8UC1);
 	
-	size_t gsize[1] = {(size_t)(src.cols * src.rows)};
-	cv::ocl::Kernel("adjust", icemet_math_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(src),
-		cv::ocl::KernelArg::PtrWriteOnly(dst),
-		a0, a1, b0, b1
-	).run(1, gsize, NULL, true);
+	if (cv::ocl::useOpenCL()) {
+		size_t gsize[1] = {(size_t)(src.cols * src.rows)};
+		kernel("adjust").args(
+			cv::ocl::KernelArg::PtrReadOnly(src),
+			cv::ocl::KernelArg::PtrWriteOnly(dst),
+			a0, a1, b0, b1
+		).run(1, gsize, NULL, false);
+	}
+	else {
+		cv::Mat mat = dst.getMat(cv::ACCESS_WRITE);
+		adjust(src.getMat(cv::ACCESS_READ), mat, a0, a1, b0, b1);
+	}
 }
 
 void Math::hist(const cv::UMat& src, cv::Mat& dst)
 {
-	cv::UMat tmp = cv::UMat::zeros(1, 256, CV_32SC1);
-	size_t gsize[1] = {(size_t)(src.cols * src.rows)};
-	cv::ocl::Kernel("imghist", icemet_math_ocl()).args(
-		cv::ocl::KernelArg::PtrReadOnly(src),
-		cv::ocl::KernelArg::PtrReadWrite(tmp)
-	).run(1, gsize, NULL, true);
-	tmp.copyTo(dst);
+	if (cv::ocl::useOpenCL()) {
+		// A few work-groups per compute unit, each with its own local histogram
+		CV_Assert(src.type() == CV_8UC1);
+		cv::UMat tmp = cv::UMat::zeros(1, 256, CV_32SC1);
+		int groups = std::max(1, std::min(src.rows, HIST_GROUPS_PER_CU * cv::ocl::Device::getDefault().maxComputeUnits()));
+		size_t gsize[1] = {(size_t)groups*HIST_LOCAL};
+		size_t lsize[1] = {HIST_LOCAL};
+		kernel("imghist").args(
+			cv::ocl::KernelArg::ReadOnly(src),
+			cv::ocl::KernelArg::PtrReadWrite(tmp)
+		).run(1, gsize, lsize, false);
+		tmp.copyTo(dst);
+	}
+	else {
+		// Private histograms per thread. Four interleaved counter sets keep the increments of
+		// a dominant background value from waiting on each other.
+		CV_Assert(src.type() == CV_8UC1);
+		dst = cv::Mat::zeros(1, 256, CV_32SC1);
+		int* H = dst.ptr<int>();
+		std::mutex mutex;
+		cv::Mat mat = src.getMat(cv::ACCESS_READ);
+		cv::parallel_for_(cv::Range(0, mat.rows), [&](const cv::Range& r) {
+			int sub[4][256] = {};
+			for (int y = r.start; y < r.end; y++) {
+				const uchar* p = mat.ptr<uchar>(y);
+				int x = 0;
+				for (; x + 4 <= mat.cols; x += 4) {
+					sub[0][p[x]]++;
+					sub[1][p[x+1]]++;
+					sub[2][p[x+2]]++;
+					sub[3][p[x+3]]++;
+				}
+				for (; x < mat.cols; x++)
+					sub[0][p[x]]++;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int i = 0; i < 256; i++)
+				H[i] += sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+		});
+	}
 }
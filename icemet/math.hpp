@@ -9,7 +9,8 @@ public:
 	static double equivdiam(double area);
 	static double heywood(double perim, double area);
 	static double Vcone(double h, double A1, double A2);
-	static int median(cv::UMat img);
+	// Median of an 8-bit image, and optionally the min and max from the same histogram
+	static int median(cv::UMat img, int* minVal=NULL, int* maxVal=NULL);
 	static void adjust(const cv::Mat& src, cv::Mat& dst, uchar a0, uchar a1, uchar b0, uchar b1);
 	static void adjust(const cv::UMat& src, cv::UMat& dst, uchar a0, uchar a1, uchar b0, uchar b1);
 	static void hist(const cv::UMat& src, cv::Mat& dst);
@@ -0,0 +1,24 @@
+#include "mem.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+size_t hostMemory()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if (!GlobalMemoryStatusEx(&status))
+		return 0;
+	return status.ullAvailPhys;
+#else
+	long pages = sysconf(_SC_AVPHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGESIZE);
+	if (pages < 0 || pageSize < 0)
+		return 0;
+	return (size_t)pages * pageSize;
+#endif
+}
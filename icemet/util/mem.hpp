@@ -0,0 +1,9 @@
+#ifndef ICEMET_MEM_H
+#define ICEMET_MEM_H
+
+#include <cstddef>
+
+// Available physical memory in bytes or 0 if unknown
+size_t hostMemory();
+
+#endif
@@ -0,0 +1,247 @@
+#include "ocl.hpp"
+
+#include "icemet/util/strfmt.hpp"
+#include "icemet/util/time.hpp"
+#include "opencl/icemet_bgsub_ocl.hpp"
+#include "opencl/icemet_crop_ocl.hpp"
+#include "opencl/icemet_math_ocl.hpp"
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#define TUNING_FILE "tuning.txt"
+#define TUNE_MIN_SIZE 16
+#define TUNE_ROUNDS 10
+
+typedef struct _cached_program {
+	std::vector<char> binary;
+	cv::ocl::ProgramSource source;
+} CachedProgram;
+
+typedef std::tuple<std::string,size_t,size_t,size_t> TuningKey;
+typedef std::array<size_t,3> TuningVal;
+
+static fs::path cacheDir;
+static std::map<std::tuple<std::string,std::string,std::string>,CachedProgram> programs;
+static std::mutex programsMutex;
+static std::map<TuningKey,TuningVal> tuning;
+static std::vector<std::string> tuningOther; // Lines of other devices
+
+static uint64_t fnv1a(const std::string& str, uint64_t hash=0xcbf29ce484222325ULL)
+{
+	for (unsigned char c : str) {
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint64_t deviceHash(uint64_t hash=0xcbf29ce484222325ULL)
+{
+	const cv::ocl::Device& dev = cv::ocl::Device::getDefault();
+	for (const std::string& str : {dev.vendorName(), dev.name(), dev.version(), dev.driverVersion()})
+		hash = fnv1a(str, hash);
+	return hash;
+}
+
+static bool readBinary(const fs::path& fn, std::vector<char>& dst)
+{
+	std::ifstream stream(fn, std::ios::binary);
+	if (!stream.is_open())
+		return false;
+	dst.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+	return !dst.empty();
+}
+
+static void writeBinary(const fs::path& fn, const std::vector<char>& src)
+{
+	// Renamed into place so that other processes never see partial binaries
+	std::error_code ec;
+	fs::create_directories(fn.parent_path(), ec);
+	fs::path tmp = fn;
+	tmp += ".tmp";
+	std::ofstream stream(tmp, std::ios::binary);
+	if (!stream.is_open())
+		return;
+	stream.write(src.data(), src.size());
+	stream.close();
+	if (!stream.fail())
+		fs::rename(tmp, fn, ec);
+	if (stream.fail() || ec)
+		fs::remove(tmp, ec);
+}
+
+static TuningKey tuningKey(const std::string& kernel, int dims, const size_t* gsize)
+{
+	return TuningKey(kernel, gsize[0], dims > 1 ? gsize[1] : 1, dims > 2 ? gsize[2] : 1);
+}
+
+static void loadTuning()
+{
+	// One line per kernel and global size: device kernel g0 g1 g2 l0 l1 l2
+	tuning.clear();
+	tuningOther.clear();
+	if (cacheDir.empty() || !cv::ocl::useOpenCL())
+		return;
+	std::ifstream stream(cacheDir / TUNING_FILE);
+	const std::string dev = strfmt("{:016x}", deviceHash());
+	std::string line;
+	while (std::getline(stream, line)) {
+		std::istringstream ss(line);
+		std::string lineDev, kernel;
+		size_t g[3], l[3];
+		if (!(ss >> lineDev >> kernel >> g[0] >> g[1] >> g[2] >> l[0] >> l[1] >> l[2]))
+			continue;
+		if (lineDev == dev)
+			tuning[TuningKey(kernel, g[0], g[1], g[2])] = {l[0], l[1], l[2]};
+		else
+			tuningOther.push_back(line);
+	}
+}
+
+void oclSetCache(const fs::path& dir)
+{
+	std::lock_guard<std::mutex> lock(programsMutex);
+	cacheDir = dir;
+	loadTuning();
+}
+
+const cv::ocl::ProgramSource& oclProgram(const char* module, const char* name, const char* code, const std::string& opts)
+{
+	std::lock_guard<std::mutex> lock(programsMutex);
+	auto key = std::make_tuple(std::string(module), std::string(name), opts);
+	auto it = programs.find(key);
+	if (it != programs.end())
+		return it->second.source;
+	
+	CachedProgram& prog = programs[key];
+	if (!cv::ocl::useOpenCL()) {
+		prog.source = cv::ocl::ProgramSource(module, name, code, "");
+		return prog.source;
+	}
+	
+	// Binaries are only valid for the device and driver they were built with
+	const uint64_t hash = deviceHash(fnv1a(opts, fnv1a(code)));
+	const std::string id = strfmt("{}_{}_{:016x}", module, name, hash);
+	const fs::path fn = cacheDir / (id + ".bin");
+	
+	// The programs end up in the context's program cache, so kernels created later don't rebuild them
+	cv::ocl::Context& ctx = cv::ocl::Context::getDefault();
+	cv::String err;
+	if (!cacheDir.empty() && readBinary(fn, prog.binary)) {
+		prog.source = cv::ocl::ProgramSource::fromBinary(module, id, (const uchar*)prog.binary.data(), prog.binary.size(), opts);
+		if (ctx.getProg(prog.source, opts, err).ptr())
+			return prog.source;
+		
+		// Stale or broken binary
+		std::error_code ec;
+		fs::remove(fn, ec);
+		prog.binary.clear();
+	}
+	prog.source = cv::ocl::ProgramSource(module, name, code, "");
+	cv::ocl::Program built = ctx.getProg(prog.source, opts, err);
+	if (!cacheDir.empty() && built.ptr()) {
+		std::vector<char> binary;
+		built.getBinary(binary);
+		if (!binary.empty())
+			writeBinary(fn, binary);
+	}
+	return prog.source;
+}
+
+void oclBuildPrograms()
+{
+	// Hologram builds its program with the variant options of the device, see Hologram::kernelOptions()
+	icemet_bgsub_ocl();
+	icemet_crop_ocl();
+	icemet_math_ocl();
+}
+
+OCLKernels::OCLKernels(const cv::ocl::ProgramSource& src, const std::string& opts)
+{
+	if (cv::ocl::useOpenCL()) {
+		cv::String err;
+		m_prog = cv::ocl::Context::getDefault().getProg(src, opts, err);
+	}
+}
+
+void oclSaveTuning()
+{
+	if (cacheDir.empty())
+		throw std::runtime_error("OpenCL cache directory not set");
+	std::error_code ec;
+	fs::create_directories(cacheDir, ec);
+	std::ofstream stream(cacheDir / TUNING_FILE);
+	if (!stream.is_open())
+		throw std::runtime_error(strfmt("Could not write '{}'", (cacheDir / TUNING_FILE).string()));
+	for (const auto& line : tuningOther)
+		stream << line << "\n";
+	const std::string dev = strfmt("{:016x}", deviceHash());
+	for (const auto& entry : tuning) {
+		const TuningKey& k = entry.first;
+		const TuningVal& l = entry.second;
+		stream << strfmt("{} {} {} {} {} {} {} {}\n", dev, std::get<0>(k), std::get<1>(k), std::get<2>(k), std::get<3>(k), l[0], l[1], l[2]);
+	}
+}
+
+double oclTune(const std::string& kernel, int dims, const size_t* gsize, const std::function<bool(const size_t*, const size_t*)>& launch)
+{
+	// Candidates are powers of two up to the device limit, zeros stand for the runtime's choice
+	const size_t maxSize = cv::ocl::Device::getDefault().maxWorkGroupSize();
+	std::vector<TuningVal> candidates{{0, 0, 0}};
+	for (size_t l0 = 1; l0 <= maxSize; l0 *= 2) {
+		for (size_t l1 = 1; l1 <= (dims > 1 ? maxSize : 1); l1 *= 2) {
+			if (l0*l1 >= TUNE_MIN_SIZE && l0*l1 <= maxSize)
+				candidates.push_back({l0, l1, 1});
+		}
+	}
+	
+	TuningVal best{0, 0, 0};
+	double bestTime = -1.0;
+	for (const auto& l : candidates) {
+		size_t g[3];
+		for (int i = 0; i < dims; i++)
+			g[i] = l[0] ? (gsize[i] + l[i]-1) / l[i] * l[i] : gsize[i];
+		const size_t* lsize = l[0] ? l.data() : NULL;
+		
+		// The first launch shows whether the kernel accepts the size at all
+		if (!launch(g, lsize))
+			continue;
+		cv::ocl::finish();
+		Measure m;
+		for (int i = 0; i < TUNE_ROUNDS; i++)
+			launch(g, lsize);
+		cv::ocl::finish();
+		double t = m.time() / TUNE_ROUNDS;
+		if (bestTime < 0 || t < bestTime) {
+			bestTime = t;
+			best = l;
+		}
+	}
+	tuning[tuningKey(kernel, dims, gsize)] = best;
+	return bestTime;
+}
+
+const size_t* oclLocalSize(const std::string& kernel, int dims, const size_t* gsize)
+{
+	auto it = tuning.find(tuningKey(kernel, dims, gsize));
+	return it != tuning.end() && it->second[0] ? it->second.data() : NULL;
+}
+
+bool oclRun(cv::ocl::Kernel& k, const std::string& kernel, int dims, const size_t* gsize)
+{
+	// The kernels check their bounds, so the global size can be rounded up to the local size
+	const size_t* lsize = oclLocalSize(kernel, dims, gsize);
+	size_t g[3];
+	for (int i = 0; i < dims; i++)
+		g[i] = lsize ? (gsize[i] + lsize[i]-1) / lsize[i] * lsize[i] : gsize[i];
+	return k.run(dims, g, (size_t*)lsize, false);
+}
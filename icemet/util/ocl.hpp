@@ -0,0 +1,44 @@
+#ifndef ICEMET_OCL_H
+#define ICEMET_OCL_H
+
+#include "icemet/icemet.hpp"
+
+#include <opencv2/core/ocl.hpp>
+
+#include <functional>
+#include <string>
+
+// Directory for compiled program binaries and the tuning table, empty disables the cache
+void oclSetCache(const fs::path& dir);
+
+// Program for the default device, built once per process and loaded from the cache when possible
+const cv::ocl::ProgramSource& oclProgram(const char* module, const char* name, const char* code, const std::string& opts=std::string());
+
+// Build all programs of the library up front
+void oclBuildPrograms();
+
+// Work-group sizes are tuned per kernel, global size and device. The table is read by oclSetCache().
+// launch runs the kernel with the given global and local sizes, a NULL local size is the runtime's choice.
+double oclTune(const std::string& kernel, int dims, const size_t* gsize, const std::function<bool(const size_t*, const size_t*)>& launch);
+void oclSaveTuning();
+const size_t* oclLocalSize(const std::string& kernel, int dims, const size_t* gsize);
+
+// Asynchronous launch with the tuned local size if there is one
+bool oclRun(cv::ocl::Kernel& k, const std::string& kernel, int dims, const size_t* gsize);
+
+// Kernels of one built program. Creating them from the program handle skips the program lookup that
+// cv::ocl::Kernel(name, source) does on every call. Kernel objects are not reused between launches
+// because OpenCV refuses to rebind or relaunch a kernel whose asynchronous launch is still running.
+class OCLKernels {
+private:
+	cv::ocl::Program m_prog;
+
+public:
+	OCLKernels() {}
+	OCLKernels(const cv::ocl::ProgramSource& src, const std::string& opts=std::string());
+	
+	bool empty() const { return m_prog.ptr() == NULL; }
+	cv::ocl::Kernel operator()(const char* name) const { return cv::ocl::Kernel(name, m_prog); }
+};
+
+#endif
@@ -1,81 +1,130 @@
 #define STACK_LEN_MAX 25
 
+// The median is taken over the samples normalised by the means of their frames and scaled
+// to the mean of the divided frame. Scaling is monotonic, so the samples of every pixel are
+// kept sorted by their normalised values and the median is found without sorting.
+__attribute__((always_inline))
+float normalise(uchar px, float mean)
+{
+	return (float)px / max(1.f, mean);
+}
+
 __kernel void push(
-	__global uchar* img,
 	__global uchar* stack,
+	__global float* means,
+	__global uchar* order,
+	__global uchar* rank,
 	int size,
-	int idx
+	int idx,
+	int count
 )
 {
+	// Move slot idx to its sorted position among the count slots in order. The old position
+	// is read from rank, the new one is a binary search over the other slots. Only the ranks
+	// between the old and the new position are rewritten, in both order and rank.
 	const int gid = get_global_id(0);
-	stack[idx*size + gid] = img[gid];
+	float val = normalise(stack[idx*size + gid], means[idx]);
+	int old = idx < count ? rank[idx*size + gid] : count;
+	int n = idx < count ? count-1 : count;
+	
+	// Binary search for the new position, skipping the old one
+	int low = 0;
+	int high = n;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		uchar k = order[(middle < old ? middle : middle+1)*size + gid];
+		if (normalise(stack[k*size + gid], means[k]) < val)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	
+	// Shift the ranks in between towards the old position
+	uchar k;
+	for (int r = old; r > low; r--) {
+		k = order[(r-1)*size + gid];
+		order[r*size + gid] = k;
+		rank[k*size + gid] = r;
+	}
+	for (int r = old; r < low; r++) {
+		k = order[(r+1)*size + gid];
+		order[r*size + gid] = k;
+		rank[k*size + gid] = r;
+	}
+	order[low*size + gid] = idx;
+	rank[idx*size + gid] = low;
 }
 
-__attribute__((always_inline))
-void swap(uchar* a, uchar* b)
+__kernel void meddiv(
+	__global uchar* stack,
+	__global float* means,
+	__global uchar* order,
+	__global uchar* dst,
+	int size,
+	int len,
+	int idx
+)
 {
-	uchar tmp = *a;
-	*a = *b;
-	*b = tmp;
+	int gid = get_global_id(0);
+	
+	// Median from the sorted slots
+	int med = order[len/2*size + gid];
+	uchar A = clamp(normalise(stack[idx*size + gid], means[idx]) * means[idx], 0.f, 255.f);
+	uchar M = clamp(normalise(stack[med*size + gid], means[med]) * means[idx], 0.f, 255.f);
+	
+	// Division
+	float val = (float)A / max(1.f, (float)M) * means[idx];
+	dst[gid] = clamp(val, 0.f, 255.f);
 }
 
+#ifdef STACK_LEN
+// Batcher's odd-even merge sort for STACK_LEN samples. The loops have constant trip counts and
+// are unrolled into min/max pairs, the pairs that don't reach the median are dead code.
 __attribute__((always_inline))
-uchar median(uchar* A, int n)
+uchar median_network(uchar* A)
 {
-	int medi = n / 2;
-	int low = 0;
-	int high = n-1;
-	while (high > low+1) {
-		int middle = (low + high) / 2;
-		swap(&A[middle], &A[low+1]);
-		
-		if (A[low] > A[high])
-			swap(&A[low], &A[high]);
-		if (A[low+1] > A[high])
-			swap(&A[low+1], &A[high]);
-		if (A[low] > A[low+1])
-			swap(&A[low], &A[low+1]);
-		
-		uchar val = A[low+1];
-		int ll = low+1;
-		int hh = high;
-		while (true) {
-			do ll++; while(A[ll] < val);
-			do hh--; while(A[hh] > val);
-			if (hh < ll) break;
-			swap(&A[ll], &A[hh]);
+	#pragma unroll
+	for (int lp = 0; (1 << lp) < STACK_LEN; lp++) {
+		#pragma unroll
+		for (int lk = lp; lk >= 0; lk--) {
+			int p = 1 << lp;
+			int k = 1 << lk;
+			#pragma unroll
+			for (int j = k % p; j + k < STACK_LEN; j += 2*k) {
+				#pragma unroll
+				for (int i = 0; i < k && i+j+k < STACK_LEN; i++) {
+					if ((i+j) / (2*p) == (i+j+k) / (2*p)) {
+						uchar a = A[i+j];
+						uchar b = A[i+j+k];
+						A[i+j] = min(a, b);
+						A[i+j+k] = max(a, b);
+					}
+				}
+			}
 		}
-		
-		A[low+1] = A[hh];
-		A[hh] = val;
-		if (hh >= medi) high = hh-1;
-		if (hh <= medi) low = ll;
 	}
-	
-	if (high == low+1 && A[high] < A[low])
-		swap(&A[low], &A[high]);
-	return A[medi];
+	return A[STACK_LEN/2];
 }
 
-__kernel void meddiv(
+__kernel void meddiv_network(
 	__global uchar* stack,
 	__global float* means,
 	__global uchar* dst,
 	int size,
-	int len,
 	int idx
 )
 {
 	int gid = get_global_id(0);
 	
 	// Fill median array
-	uchar A[STACK_LEN_MAX];
-	for (int i = 0; i < len; i++) {
-		float val = (float)stack[i*size + gid] / max(1.f, means[i]) * means[idx];
-		A[i] = clamp(val, 0.f, 255.f);
-	}
+	uchar A[STACK_LEN];
+	#pragma unroll
+	for (int i = 0; i < STACK_LEN; i++)
+		A[i] = clamp(normalise(stack[i*size + gid], means[i]) * means[idx], 0.f, 255.f);
+	uchar B = clamp(normalise(stack[idx*size + gid], means[idx]) * means[idx], 0.f, 255.f);
 	
 	// Division
-	float val = (float)A[idx] / max(1.f, (float)median(A, len)) * means[idx];
+	float val = (float)B / max(1.f, (float)median_network(A)) * means[idx];
 	dst[gid] = clamp(val, 0.f, 255.f);
 }
+#endif
@@ -0,0 +1,60 @@
+#define CROP_LOCAL 256
+#define INTER_BITS 5
+#define INTER_TAB_SIZE (1 << INTER_BITS)
+
+__attribute__((always_inline))
+float crop_px(__global const uchar* src, int step, int offset, int x0, int y0, int w, int h, int x, int y)
+{
+	return x >= 0 && y >= 0 && x < w && y < h ? (float)src[offset + (y0+y)*step + x0+x] : 0.f;
+}
+
+__kernel __attribute__((reqd_work_group_size(CROP_LOCAL, 1, 1)))
+void crop(
+	__global const uchar* src, int src_step, int src_offset, int src_rows, int src_cols,
+	__global uchar* dst, int dst_step, int dst_offset,
+	__global uchar* fdst, int fdst_step, int fdst_offset, int fdst_on,
+	__global const short2* map,
+	__global const ushort* frac,
+	int remap,
+	__global uint* sums,
+	int x0, int y0, int w, int h
+)
+{
+	// Crop rectangle (x0, y0, w, h) of src to dst. With remap the pixel is interpolated at the
+	// integer and fractional source position in the tables, zero outside the rectangle.
+	// The result is also written as float to fdst if fdst_on is set, and the sum of every
+	// work-group is written to sums for the mean.
+	int gid = get_global_id(0);
+	int lid = get_local_id(0);
+	uint val = 0;
+	if (gid < w*h) {
+		int y = gid / w;
+		int x = gid - y*w;
+		if (remap) {
+			short2 p = map[gid];
+			int f = frac[gid];
+			float ax = (float)(f & (INTER_TAB_SIZE-1)) / INTER_TAB_SIZE;
+			float ay = (float)(f >> INTER_BITS) / INTER_TAB_SIZE;
+			float top = mix(crop_px(src, src_step, src_offset, x0, y0, w, h, p.x, p.y), crop_px(src, src_step, src_offset, x0, y0, w, h, p.x+1, p.y), ax);
+			float bottom = mix(crop_px(src, src_step, src_offset, x0, y0, w, h, p.x, p.y+1), crop_px(src, src_step, src_offset, x0, y0, w, h, p.x+1, p.y+1), ax);
+			val = convert_uchar_sat_rte(mix(top, bottom, ay));
+		}
+		else {
+			val = src[src_offset + (y0+y)*src_step + x0+x];
+		}
+		dst[dst_offset + y*dst_step + x] = val;
+		if (fdst_on)
+			*(__global float*)(fdst + fdst_offset + y*fdst_step + x*sizeof(float)) = val;
+	}
+	
+	__local uint buf[CROP_LOCAL];
+	buf[lid] = val;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int s = CROP_LOCAL/2; s > 0; s >>= 1) {
+		if (lid < s)
+			buf[lid] += buf[lid + s];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		sums[get_group_id(0)] = buf[0];
+}
@@ -2,6 +2,20 @@
 
 typedef float2 cfloat;
 
+// Spectra and transfer functions are stored in half precision with -D STORAGE_HALF.
+// They are converted with vload_half/vstore_half, the arithmetic is always done in fp32.
+#ifdef STORAGE_HALF
+typedef half cstore;
+#define load_c(p, i) vload_half2(i, p)
+#define load_r(p, i) vload_half(i, p)
+#define store_c(p, i, v) vstore_half2(v, i, p)
+#else
+typedef float cstore;
+#define load_c(p, i) vload2(i, p)
+#define load_r(p, i) (p)[i]
+#define store_c(p, i, v) vstore2(v, i, p)
+#endif
+
 __attribute__((always_inline))
 cfloat cnum(float r, float i)
 {
@@ -40,6 +54,25 @@ cfloat ccos(cfloat z)
 	return (cfloat)(cos(x) * cosh(y), -sin(x) * sinh(y));
 }
 
+__attribute__((always_inline))
+int quadrant_idx(int i, int w, int h)
+{
+	int x = i % w;
+	int y = i / w;
+	int qx = x <= w/2 ? x : w - x;
+	int qy = y <= h/2 ? y : h - y;
+	return qy*(w/2 + 1) + qx;
+}
+
+__attribute__((always_inline))
+int2 ccs_freq(int x, int y, int w)
+{
+	// Frequency (u, v) of an element in the packed CCS spectrum of a real image
+	if (x == 0 || (w%2 == 0 && x == w-1))
+		return (int2)(x == 0 ? 0 : w/2, (y+1)/2);
+	return (int2)((x+1)/2, y);
+}
+
 __attribute__((always_inline))
 float limit(float val)
 {
@@ -58,101 +91,288 @@ float phase(cfloat val)
 	return limit(255.f * (atan(val.y / val.x) + PI/2) / PI);
 }
 
+// Per-pixel kernels handle PIXELS consecutive pixels of a row per work-item. With -D PIXEL_VEC4
+// four pixels are read as one float8 and written as one float4/uchar4, the row tail is done per pixel.
+#ifdef PIXEL_VEC4
+#define PIXELS 4
+
+__attribute__((always_inline))
+float4 amplitude4(float8 v)
+{
+	return clamp(sqrt(v.even*v.even + v.odd*v.odd), 0.f, 255.f);
+}
+
 __attribute__((always_inline))
-cfloat normalize_phase(cfloat val, float lambda, float z)
+float4 phase4(float8 v, cfloat ph)
 {
-	cfloat f = cexp(cmul(cnum(2 * PI * z / lambda, 0), cnum(0, 1)));
-	cfloat H = cexp(cmul(atan(f.y / f.x), cnum(0, -1)));
-	return cmul(val, H);
+	float4 re = v.even*ph.x - v.odd*ph.y;
+	float4 im = v.even*ph.y + v.odd*ph.x;
+	return clamp(255.f * (atan(im / re) + PI/2) / PI, 0.f, 255.f);
 }
 
+#else
+#define PIXELS 1
+#endif
+
+// Row y of a buffer passed with KernelArg::ReadOnly/WriteOnly. Offset and step are in bytes,
+// so views into a larger buffer (e.g. planes of a contiguous stack) are addressed correctly.
+#define ROW(T, p, offset, step, y) ((__global T*)((__global uchar*)(p) + (offset) + (y)*(step)))
+
+// ph is the phase correction of the plane, computed once per plane on the host
 __kernel void a_f32(
 	__global cfloat* src, int src_step, int src_offset, int src_h, int src_w,
 	__global float* dst, int dst_step, int dst_offset, int dst_h, int dst_w,
-	float lambda, float z
+	cfloat ph
 )
 {
-	int x = get_global_id(0);
+	int x = get_global_id(0) * PIXELS;
 	int y = get_global_id(1);
 	if (x >= dst_w || y >= dst_h) return;
+	__global const cfloat* s = ROW(const cfloat, src, src_offset, src_step, y);
+	__global float* d = ROW(float, dst, dst_offset, dst_step, y);
 	
-	dst[y*dst_w + x] = amplitude(src[y*src_w + x]);
+#ifdef PIXEL_VEC4
+	if (x + 4 <= dst_w) {
+		float8 v = vload8(0, (__global const float*)(s + x));
+		vstore4(amplitude4(v), 0, d + x);
+		return;
+	}
+#endif
+	for (int i = x; i < min(x + PIXELS, dst_w); i++)
+		d[i] = amplitude(s[i]);
 }
 
 __kernel void p_f32(
 	__global cfloat* src, int src_step, int src_offset, int src_h, int src_w,
 	__global float* dst, int dst_step, int dst_offset, int dst_h, int dst_w,
-	float lambda, float z
+	cfloat ph
 )
 {
-	int x = get_global_id(0);
+	int x = get_global_id(0) * PIXELS;
 	int y = get_global_id(1);
 	if (x >= dst_w || y >= dst_h) return;
+	__global const cfloat* s = ROW(const cfloat, src, src_offset, src_step, y);
+	__global float* d = ROW(float, dst, dst_offset, dst_step, y);
 	
-	dst[y*dst_w + x] = phase(normalize_phase(src[y*src_w + x], lambda, z));
+#ifdef PIXEL_VEC4
+	if (x + 4 <= dst_w) {
+		float8 v = vload8(0, (__global const float*)(s + x));
+		vstore4(phase4(v, ph), 0, d + x);
+		return;
+	}
+#endif
+	for (int i = x; i < min(x + PIXELS, dst_w); i++)
+		d[i] = phase(cmul(s[i], ph));
 }
 
 __kernel void amin_8u(
 	__global cfloat* src, int src_step, int src_offset, int src_h, int src_w,
 	__global uchar* dst, int dst_step, int dst_offset, int dst_h, int dst_w,
-	float lambda, float z
+	cfloat ph
 )
 {
-	int x = get_global_id(0);
+	int x = get_global_id(0) * PIXELS;
 	int y = get_global_id(1);
 	if (x >= dst_w || y >= dst_h) return;
+	__global const cfloat* s = ROW(const cfloat, src, src_offset, src_step, y);
+	__global uchar* d = ROW(uchar, dst, dst_offset, dst_step, y);
 	
-	uchar a = amplitude(src[y*src_w + x]);
-	dst[y*dst_w + x] = min(dst[y*dst_w + x], a);
+#ifdef PIXEL_VEC4
+	if (x + 4 <= dst_w) {
+		float8 v = vload8(0, (__global const float*)(s + x));
+		uchar4 a = convert_uchar4(amplitude4(v));
+		vstore4(min(vload4(0, d + x), a), 0, d + x);
+		return;
+	}
+#endif
+	for (int i = x; i < min(x + PIXELS, dst_w); i++) {
+		uchar a = amplitude(s[i]);
+		d[i] = min(d[i], a);
+	}
 }
 
 __kernel void pmin_8u(
 	__global cfloat* src, int src_step, int src_offset, int src_h, int src_w,
 	__global uchar* dst, int dst_step, int dst_offset, int dst_h, int dst_w,
-	float lambda, float z
+	cfloat ph
 )
 {
-	int x = get_global_id(0);
+	int x = get_global_id(0) * PIXELS;
 	int y = get_global_id(1);
 	if (x >= dst_w || y >= dst_h) return;
+	__global const cfloat* s = ROW(const cfloat, src, src_offset, src_step, y);
+	__global uchar* d = ROW(uchar, dst, dst_offset, dst_step, y);
 	
-	uchar p = phase(normalize_phase(src[y*src_w + x], lambda, z));
-	dst[y*dst_w + x] = min(dst[y*dst_w + x], p);
+#ifdef PIXEL_VEC4
+	if (x + 4 <= dst_w) {
+		float8 v = vload8(0, (__global const float*)(s + x));
+		uchar4 p = convert_uchar4(phase4(v, ph));
+		vstore4(min(vload4(0, d + x), p), 0, d + x);
+		return;
+	}
+#endif
+	for (int i = x; i < min(x + PIXELS, dst_w); i++) {
+		uchar p = phase(cmul(s[i], ph));
+		d[i] = min(d[i], p);
+	}
 }
 
 __kernel void a_amin_8u(
 	__global cfloat* src, int src_step, int src_offset, int src_h, int src_w,
 	__global uchar* dst, int dst_step, int dst_offset, int dst_h, int dst_w,
 	__global uchar* dst_min,
-	float lambda, float z
+	cfloat ph
 )
 {
-	int x = get_global_id(0);
+	int x = get_global_id(0) * PIXELS;
 	int y = get_global_id(1);
 	if (x >= dst_w || y >= dst_h) return;
+	__global const cfloat* s = ROW(const cfloat, src, src_offset, src_step, y);
+	__global uchar* d = ROW(uchar, dst, dst_offset, dst_step, y);
 	
-	cfloat val = src[y*src_w + x];
-	uchar a = amplitude(val);
-	dst[y*dst_w + x] = a;
-	dst_min[y*dst_w + x] = min(dst_min[y*dst_w + x], a);
+#ifdef PIXEL_VEC4
+	if (x + 4 <= dst_w) {
+		float8 v = vload8(0, (__global const float*)(s + x));
+		uchar4 a = convert_uchar4(amplitude4(v));
+		vstore4(a, 0, d + x);
+		vstore4(min(vload4(0, dst_min + y*dst_w + x), a), 0, dst_min + y*dst_w + x);
+		return;
+	}
+#endif
+	for (int i = x; i < min(x + PIXELS, dst_w); i++) {
+		uchar a = amplitude(s[i]);
+		d[i] = a;
+		dst_min[y*dst_w + i] = min(dst_min[y*dst_w + i], a);
+	}
 }
 
 __kernel void a_pmin_8u(
 	__global cfloat* src, int src_step, int src_offset, int src_h, int src_w,
 	__global uchar* dst, int dst_step, int dst_offset, int dst_h, int dst_w,
 	__global uchar* dst_min,
-	float lambda, float z
+	cfloat ph
 )
 {
-	int x = get_global_id(0);
+	int x = get_global_id(0) * PIXELS;
 	int y = get_global_id(1);
 	if (x >= dst_w || y >= dst_h) return;
+	__global const cfloat* s = ROW(const cfloat, src, src_offset, src_step, y);
+	__global uchar* d = ROW(uchar, dst, dst_offset, dst_step, y);
+	
+#ifdef PIXEL_VEC4
+	if (x + 4 <= dst_w) {
+		float8 v = vload8(0, (__global const float*)(s + x));
+		vstore4(convert_uchar4(amplitude4(v)), 0, d + x);
+		vstore4(min(vload4(0, dst_min + y*dst_w + x), convert_uchar4(phase4(v, ph))), 0, dst_min + y*dst_w + x);
+		return;
+	}
+#endif
+	for (int i = x; i < min(x + PIXELS, dst_w); i++) {
+		cfloat val = s[i];
+		d[i] = amplitude(val);
+		dst_min[y*dst_w + i] = min(dst_min[y*dst_w + i], (uchar)phase(cmul(val, ph)));
+	}
+}
+
+#define TILE 16
+
+__attribute__((always_inline))
+float tile_var(__local float4* buf, int lid, float val, int inside)
+{
+	// Variance of the values of a TILE x TILE work-group, valid in work-item 0
+	buf[lid] = inside ? (float4)(val, val*val, 1.0, 0.0) : (float4)(0.0);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int n = TILE*TILE/2; n > 0; n /= 2) {
+		if (lid < n)
+			buf[lid] += buf[lid + n];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	float4 acc = buf[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	float mean = acc.x / acc.z;
+	return acc.y / acc.z - mean*mean;
+}
+
+__kernel void amin_8u_batch(
+	__global cfloat* src, int sx, int sy, int sk, int n,
+	__global uchar* dst, int dst_offset, int store, int dst_h, int dst_w,
+	__global uchar* dst_min,
+	__global cfloat* ph,
+	int output,
+	__global float* tiles, int tiles_on, int tiles_first, int tiles_x
+)
+{
+	// src holds n planes with element strides sx, sy and sk. x is dimension 0, so the stores
+	// are contiguous. Planes contiguous in y (sx != 1) are read in TILE x TILE work-groups with
+	// y as the fastest index and transposed through local memory.
+	// With tiles_on the work-groups are TILE x TILE and the amplitude variance of each tile is written too
+	__local float4 buf[TILE*TILE];
+	__local cfloat tr[TILE*(TILE+1)];
+	int lx = get_local_id(0);
+	int ly = get_local_id(1);
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int transp = sx != 1;
+	int inside = x < dst_w && y < dst_h;
+	if (!inside && !tiles_on && !transp) return;
+	
+	// Work-item (lx, ly) of a transposed read loads pixel (ly, lx) of the tile
+	int rx = get_group_id(0)*TILE + ly;
+	int ry = get_group_id(1)*TILE + lx;
+	int rinside = rx < dst_w && ry < dst_h;
 	
-	cfloat val = src[y*src_w + x];
-	uchar a = amplitude(val);
-	uchar p = phase(normalize_phase(val, lambda, z));
-	dst[y*dst_w + x] = a;
-	dst_min[y*dst_w + x] = min(dst_min[y*dst_w + x], p);
+	int size = dst_h * dst_w;
+	int lid = ly*TILE + lx;
+	int ntiles = tiles_x * ((dst_h + TILE-1) / TILE);
+	int tile = get_group_id(1)*tiles_x + get_group_id(0);
+	dst += dst_offset;
+	uchar val_min = inside ? dst_min[y*dst_w + x] : 0;
+	for (int k = 0; k < n; k++) {
+		cfloat val = (cfloat)(0.0);
+		if (transp) {
+			if (rinside)
+				tr[ly*(TILE+1) + lx] = src[rx*sx + ry*sy + k*sk];
+			barrier(CLK_LOCAL_MEM_FENCE);
+			val = tr[lx*(TILE+1) + ly];
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		else if (inside) {
+			val = src[x*sx + y*sy + k*sk];
+		}
+		
+		uchar a = 0;
+		if (inside) {
+			a = amplitude(val);
+			if (store)
+				dst[k*size + y*dst_w + x] = a;
+			val_min = min(val_min, output == 0 ? a : (uchar)phase(cmul(val, ph[k])));
+		}
+		if (tiles_on) {
+			float var = tile_var(buf, lid, a, inside);
+			if (lid == 0)
+				tiles[(tiles_first + k)*ntiles + tile] = var;
+		}
+	}
+	if (inside)
+		dst_min[y*dst_w + x] = val_min;
+}
+
+__kernel void tiles_8u(
+	__global const uchar* src, int src_step, int src_offset, int src_h, int src_w,
+	__global float* tiles, int tiles_idx, int tiles_x
+)
+{
+	// Amplitude variance of TILE x TILE tiles of a stored plane
+	__local float4 buf[TILE*TILE];
+	int y = get_global_id(0);
+	int x = get_global_id(1);
+	int inside = x < src_w && y < src_h;
+	int lid = get_local_id(0)*TILE + get_local_id(1);
+	int ntiles = tiles_x * ((src_h + TILE-1) / TILE);
+	float val = inside ? src[src_offset + y*src_step + x] : 0.0;
+	float var = tile_var(buf, lid, val, inside);
+	if (lid == 0)
+		tiles[tiles_idx*ntiles + get_group_id(0)*tiles_x + get_group_id(1)] = var;
 }
 
 __kernel void angularspectrum(
@@ -174,15 +394,129 @@ __kernel void angularspectrum(
 }
 
 __kernel void propagate(
-	__global cfloat* src,
+	__global const cstore* src,
+	__global cfloat* prop,
+	__global cfloat* dst,
+	float z,
+	__global float* filt, int filt_on, int w, int h
+)
+{
+	// x * e^(z * prop) * F
+	int i = get_global_id(0);
+	cfloat H = cexp(cmul(prop[i], cnum(z, 0)));
+	if (filt_on)
+		H *= filt[quadrant_idx(i, w, h)];
+	dst[i] = cmul(load_c(src, i), H);
+}
+
+__kernel void propagate_cached(
+	__global const cstore* src,
+	__global const cstore* cache,
+	__global cfloat* dst,
+	int idx, int w, int h
+)
+{
+	// x * H
+	int i = get_global_id(0);
+	int qsize = (w/2 + 1) * (h/2 + 1);
+	dst[i] = cmul(load_c(src, i), load_c(cache, idx*qsize + quadrant_idx(i, w, h)));
+}
+
+__kernel void propagate_batch(
+	__global const cstore* src,
 	__global cfloat* prop,
+	__global const cstore* cache,
 	__global cfloat* dst,
-	float z
+	__global float* z,
+	__global int* idx,
+	int w, int h,
+	__global float* filt, int filt_on
 )
 {
-	// x * e^(z * prop)
+	// x * e^(z[k] * prop) * F, or x * H if the plane is cached
 	int i = get_global_id(0);
-	dst[i] = cmul(src[i], cexp(cmul(prop[i], cnum(z, 0))));
+	int k = get_global_id(1);
+	int qsize = (w/2 + 1) * (h/2 + 1);
+	cfloat H;
+	if (idx[k] < 0) {
+		H = cexp(cmul(prop[i], cnum(z[k], 0)));
+		if (filt_on)
+			H *= filt[quadrant_idx(i, w, h)];
+	}
+	else {
+		H = load_c(cache, idx[k]*qsize + quadrant_idx(i, w, h));
+	}
+	dst[k*w*h + i] = cmul(load_c(src, i), H);
+}
+
+__kernel void propagate_ccs(
+	__global const cstore* src,
+	__global float* prop,
+	__global const cstore* cache,
+	__global float* dst_re,
+	__global float* dst_im,
+	float z, int idx, int w, int h,
+	__global float* filt, int filt_on
+)
+{
+	// x * Re(H) and x * Im(H) in packed CCS layout
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= w || y >= h) return;
+	
+	int i = y*w + x;
+	int2 f = ccs_freq(x, y, w);
+	int q = (f.y <= h/2 ? f.y : h - f.y)*(w/2 + 1) + f.x;
+	cfloat H;
+	if (idx < 0) {
+		H = cnum(cos(z * prop[i]), sin(z * prop[i]));
+		if (filt_on)
+			H *= filt[q];
+	}
+	else {
+		H = load_c(cache, idx*(w/2 + 1)*(h/2 + 1) + q);
+	}
+	float val = load_r(src, i);
+	dst_re[i] = val * H.x;
+	dst_im[i] = val * H.y;
+}
+
+__kernel void ccs_expand(
+	__global cfloat* src,
+	__global float* dst,
+	int w, int h,
+	int part
+)
+{
+	// Real or imaginary part of a full spectrum in packed CCS layout
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= w || y >= h) return;
+	
+	int2 f = ccs_freq(x, y, w);
+	cfloat val = src[f.y*w + f.x];
+	dst[y*w + x] = part == 0 ? val.x : val.y;
+}
+
+__kernel void transferfunction(
+	__global cfloat* prop, int w, int h,
+	__global cstore* dst,
+	__global float* z,
+	__global float* filt, int filt_on
+)
+{
+	// e^(z[k] * prop) * F for one quadrant
+	int qx = get_global_id(0);
+	int qy = get_global_id(1);
+	int k = get_global_id(2);
+	int qw = w/2 + 1;
+	int qh = h/2 + 1;
+	if (qx >= qw || qy >= qh) return;
+	
+	cfloat H = cexp(cmul(prop[qy*w + qx], cnum(z[k], 0)));
+	if (filt_on)
+		H *= filt[qy*qw + qx];
+	store_c(dst, k*qw*qh + qy*qw + qx, H);
 }
 
 __kernel void supergaussian(
@@ -204,53 +538,187 @@ __kernel void supergaussian(
 	H[y*w + x] = cnum(type == 0 ? filter : 1-filter, 0.0);
 }
 
-__kernel void stdfilt_3x3(
-	__global float* src,
-	__global float* dst, int step, int offset, int h, int w
+#define FOCUS_FILTER_NONE 0
+#define FOCUS_FILTER_STD 1
+#define FOCUS_FILTER_GRAD 2
+#define FOCUS_LOCAL 64
+
+__attribute__((always_inline))
+float focus_px(__global const uchar* src, int step, int is_float, int x, int y)
+{
+	__global const uchar* row = src + y*step;
+	return is_float ? ((__global const float*)row)[x] : (float)row[x];
+}
+
+__attribute__((always_inline))
+float focus_val(__global const uchar* src, int step, int is_float, int x, int y, int w, int h, int filter)
+{
+	if (filter == FOCUS_FILTER_STD) {
+		// Standard deviation of the 3x3 neighbourhood
+		float sum = 0.0;
+		float sqsum = 0.0;
+		int n = 0;
+		for (int yy = max(y-1, 0); yy <= min(y+1, h-1); yy++) {
+			for (int xx = max(x-1, 0); xx <= min(x+1, w-1); xx++) {
+				float val = focus_px(src, step, is_float, xx, yy);
+				sum += val;
+				sqsum += val*val;
+				n++;
+			}
+		}
+		float mean = sum / n;
+		return sqrt(fabs(sqsum / n - mean*mean));
+	}
+	else if (filter == FOCUS_FILTER_GRAD) {
+		// Squared gradient magnitude
+		float valx = 0.0;
+		float valy = 0.0;
+		if (x > 0)
+			valx -= 0.5*focus_px(src, step, is_float, x-1, y);
+		if (x < w-1)
+			valx += 0.5*focus_px(src, step, is_float, x+1, y);
+		if (y > 0)
+			valy -= 0.5*focus_px(src, step, is_float, x, y-1);
+		if (y < h-1)
+			valy += 0.5*focus_px(src, step, is_float, x, y+1);
+		return valx*valx + valy*valy;
+	}
+	return focus_px(src, step, is_float, x, y);
+}
+
+__attribute__((always_inline))
+float4 focus_acc(float4 acc, float val)
+{
+	return (float4)(fmin(acc.x, val), fmax(acc.y, val), acc.z + val, acc.w + val*val);
+}
+
+#ifdef FOCUS_TILED
+// With -D FOCUS_TILED the ROI is read in tiles of FOCUS_LOCAL x FOCUS_TILE_H pixels to local memory.
+// The one pixel border outside the ROI is zero, so the stencils need no branches besides the 3x3 count.
+#define FOCUS_TILE_H 8
+#define FOCUS_TILE_W (FOCUS_LOCAL + 2)
+
+__attribute__((always_inline))
+float focus_val_tile(__local const float* tile, int lx, int ly, int x, int y, int w, int h, int filter)
+{
+	__local const float* p = tile + ly*FOCUS_TILE_W + lx;
+	if (filter == FOCUS_FILTER_STD) {
+		float sum = 0.0;
+		float sqsum = 0.0;
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				float val = p[dy*FOCUS_TILE_W + dx];
+				sum += val;
+				sqsum += val*val;
+			}
+		}
+		int n = (min(x+1, w-1) - max(x-1, 0) + 1) * (min(y+1, h-1) - max(y-1, 0) + 1);
+		float mean = sum / n;
+		return sqrt(fabs(sqsum / n - mean*mean));
+	}
+	else if (filter == FOCUS_FILTER_GRAD) {
+		float valx = 0.5*(p[1] - p[-1]);
+		float valy = 0.5*(p[FOCUS_TILE_W] - p[-FOCUS_TILE_W]);
+		return valx*valx + valy*valy;
+	}
+	return p[0];
+}
+
+float4 focus_tiles(__global const uchar* src, int step, int is_float, int w, int h, int filter, int t0, int dt, __local float* tile, float4 acc)
+{
+	// Tiles t0, t0+dt, ... of the ROI, the loop is uniform over the work-group
+	int lid = get_local_id(0);
+	int tw = (w + FOCUS_LOCAL-1) / FOCUS_LOCAL;
+	int th = (h + FOCUS_TILE_H-1) / FOCUS_TILE_H;
+	for (int t = t0; t < tw*th; t += dt) {
+		int x0 = (t % tw) * FOCUS_LOCAL;
+		int y0 = (t / tw) * FOCUS_TILE_H;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = lid; i < FOCUS_TILE_W*(FOCUS_TILE_H + 2); i += FOCUS_LOCAL) {
+			int xx = x0 - 1 + i % FOCUS_TILE_W;
+			int yy = y0 - 1 + i / FOCUS_TILE_W;
+			tile[i] = xx >= 0 && xx < w && yy >= 0 && yy < h ? focus_px(src, step, is_float, xx, yy) : 0.0;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		
+		int x = x0 + lid;
+		for (int r = 0; r < FOCUS_TILE_H && x < w && y0 + r < h; r++)
+			acc = focus_acc(acc, focus_val_tile(tile, lid + 1, r + 1, x, y0 + r, w, h, filter));
+	}
+	return acc;
+}
+#endif
+
+__kernel void focus_stats(
+	__global const uchar* src, int src_step, int src_offset, int src_h, int src_w,
+	__global float4* dst, int dst_idx, int is_float, int filter
 )
 {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	if (x >= w || y >= h) return;
+	// Min, max, sum and squared sum of the filtered slice, one partial result per work-group
+	__local float4 buf[FOCUS_LOCAL];
+	int lid = get_local_id(0);
+	src += src_offset;
 	
-	float sum = 0.0;
-	float sqsum = 0.0;
-	int n = 0;
-	for (int xx = max(x-1, 0); xx <= min(x+1, w-1); xx++) {
-		for (int yy = max(y-1, 0); yy <= min(y+1, h-1); yy++) {
-			float val = src[yy*w + xx];
-			sum += val;
-			sqsum += val*val;
-			n++;
+	float4 acc = (float4)(INFINITY, -INFINITY, 0.0, 0.0);
+#ifdef FOCUS_TILED
+	__local float tile[FOCUS_TILE_W*(FOCUS_TILE_H + 2)];
+	acc = focus_tiles(src, src_step, is_float, src_w, src_h, filter, get_group_id(0), get_num_groups(0), tile, acc);
+#else
+	for (int i = get_global_id(0); i < src_w*src_h; i += get_global_size(0))
+		acc = focus_acc(acc, focus_val(src, src_step, is_float, i % src_w, i / src_w, src_w, src_h, filter));
+#endif
+	buf[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	for (int n = FOCUS_LOCAL/2; n > 0; n /= 2) {
+		if (lid < n) {
+			float4 a = buf[lid];
+			float4 b = buf[lid + n];
+			buf[lid] = (float4)(fmin(a.x, b.x), fmax(a.y, b.y), a.z + b.z, a.w + b.w);
 		}
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
-	float mean = sum / n;
-	float var = fabs(sqsum / n - mean*mean);
-	dst[y*w + x] = sqrt(var);
+	if (lid == 0)
+		dst[dst_idx*get_num_groups(0) + get_group_id(0)] = buf[0];
 }
 
-__kernel void gradient(
-	__global float* src,
-	__global float* fx,
-	__global float* fy,
-	int step, int offset, int h, int w
+__kernel void focus_stats_multi(
+	__global const uchar* src, int src_step,
+	__global const int* probes,
+	__global float4* dst,
+	int first, int n, int is_float
 )
 {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	if (x >= w || y >= h) return;
+	// One work-group per probe, a probe is (byte offset, x, y, w, h, filter) in the buffer src
+	int p = get_group_id(0);
+	if (p >= n) return;
+	__local float4 buf[FOCUS_LOCAL];
+	int lid = get_local_id(0);
+	__global const int* probe = probes + 6*(first + p);
+	__global const uchar* roi = src + probe[0] + probe[2]*src_step + probe[1]*(is_float ? 4 : 1);
+	int w = probe[3];
+	int h = probe[4];
+	int filter = probe[5];
 	
-	float valx = 0.0;
-	float valy = 0.0;
-	if (x > 0)
-		valx -= 0.5*src[y*w + x-1];
-	if (x < w-1)
-		valx += 0.5*src[y*w + x+1];
-	if (y > 0)
-		valy -= 0.5*src[(y-1)*w + x];
-	if (y < h-1)
-		valy += 0.5*src[(y+1)*w + x];
+	float4 acc = (float4)(INFINITY, -INFINITY, 0.0, 0.0);
+#ifdef FOCUS_TILED
+	__local float tile[FOCUS_TILE_W*(FOCUS_TILE_H + 2)];
+	acc = focus_tiles(roi, src_step, is_float, w, h, filter, 0, 1, tile, acc);
+#else
+	for (int i = lid; i < w*h; i += FOCUS_LOCAL)
+		acc = focus_acc(acc, focus_val(roi, src_step, is_float, i % w, i / w, w, h, filter));
+#endif
+	buf[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
 	
-	fx[y*w + x] = valx;
-	fy[y*w + x] = valy;
+	for (int k = FOCUS_LOCAL/2; k > 0; k /= 2) {
+		if (lid < k) {
+			float4 a = buf[lid];
+			float4 b = buf[lid + k];
+			buf[lid] = (float4)(fmin(a.x, b.x), fmax(a.y, b.y), a.z + b.z, a.w + b.w);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		dst[first + p] = buf[0];
 }
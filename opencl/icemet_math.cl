@@ -10,7 +10,28 @@ __kernel void adjust(
 	dst[i] = (val-a0) / (a1-a0) * (b1-b0) + b0;
 }
 
-__kernel void imghist(__global uchar* src, __global int* dst)
+#define HIST_LOCAL 256
+
+__kernel __attribute__((reqd_work_group_size(HIST_LOCAL, 1, 1)))
+void imghist(
+	__global const uchar* src, int src_step, int src_offset, int src_rows, int src_cols,
+	__global int* dst
+)
 {
-	atomic_inc(&dst[src[get_global_id(0)]]);
+	// Every work-group counts its rows to a histogram in local memory,
+	// the bins are added to dst once per work-group
+	__local int hist[HIST_LOCAL];
+	int lid = get_local_id(0);
+	hist[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	for (int y = get_group_id(0); y < src_rows; y += get_num_groups(0)) {
+		__global const uchar* row = src + src_offset + y*src_step;
+		for (int x = lid; x < src_cols; x += HIST_LOCAL)
+			atomic_inc(&hist[row[x]]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (hist[lid] > 0)
+		atomic_add(&dst[lid], hist[lid]);
 }
@@ -5,10 +5,9 @@ header_file_fmt = "{name}_ocl.hpp"
 header_string = (
 "#ifndef {definition}_OCL_HPP\n"
 "#define {definition}_OCL_HPP\n"
-"#include <opencv2/core/ocl.hpp>\n"
-"const cv::ocl::ProgramSource& {module}_{name}_ocl() {{\n"
-"static cv::ocl::ProgramSource source(\"{module}\", \"{name}\", \"{kernel}\", \"\");\n"
-"return source;\n"
+"#include \"icemet/util/ocl.hpp\"\n"
+"inline const cv::ocl::ProgramSource& {module}_{name}_ocl(const std::string& opts=std::string()) {{\n"
+"return oclProgram(\"{module}\", \"{name}\", \"{kernel}\", opts);\n"
 "}}\n"
 "#endif\n"
 )
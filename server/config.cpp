@@ -29,6 +29,7 @@ Config::Config(const Config& cfg) :
 	segment(cfg.segment),
 	particle(cfg.particle),
 	diamCorr(cfg.diamCorr),
+	backend(cfg.backend),
 	ocl(cfg.ocl) {}
 
 fs::path Config::strToPath(const std::string& str) const
@@ -99,6 +100,7 @@ void Config::load(const fs::path& fn)
 		img.rotation = getYAMLNode(node, "img_rotation").as<float>();
 		
 		bgsub.stackLen = getYAMLNode(node, "bgsub_stack_len").as<int>();
+		bgsub.network = getYAMLNode(node, "bgsub_network").as<bool>();
 		
 		emptyCheck.originalTh = getYAMLNode(node, "empty_th_original").as<int>();
 		emptyCheck.preprocTh = getYAMLNode(node, "empty_th_preproc").as<int>();
@@ -115,8 +117,18 @@ void Config::load(const fs::path& fn)
 		hologram.psz = getYAMLNode(node, "holo_pixel_size").as<float>();
 		hologram.lambda = getYAMLNode(node, "holo_lambda").as<float>();
 		hologram.dist = getYAMLNode(node, "holo_distance").as<float>();
-		hologram.reconStep = getYAMLNode(node, "recon_step").as<int>();
+		YAML::Node reconStep = getYAMLNode(node, "recon_step");
+		hologram.reconStep = reconStep.as<std::string>() == "auto" ? 0 : reconStep.as<int>();
+		hologram.reconBatch = getYAMLNode(node, "recon_batch").as<int>();
+		hologram.reconCache = getYAMLNode(node, "recon_cache").as<int>();
+		hologram.halfSpectrum = getYAMLNode(node, "recon_half_spectrum").as<bool>();
+		hologram.fp16 = getYAMLNode(node, "recon_fp16").as<bool>();
+		hologram.reconPatch = getYAMLNode(node, "recon_patch").as<int>();
+		hologram.reconCoarse = getYAMLNode(node, "recon_coarse").as<int>();
 		hologram.focusStep = getYAMLNode(node, "focus_step").as<double>();
+		hologram.focusInterp = getYAMLNode(node, "focus_interp").as<bool>();
+		hologram.focusTiles = getYAMLNode(node, "focus_tiles").as<bool>();
+		hologram.focusExact = getYAMLNode(node, "focus_exact").as<bool>();
 		hologram.focusMethod = static_cast<FocusMethod>(getYAMLNode(node, "focus_method").as<int>());
 		hologram.focusMethodSmall = static_cast<FocusMethod>(getYAMLNode(node, "focus_method_small").as<int>());
 		
@@ -150,7 +162,11 @@ void Config::load(const fs::path& fn)
 		stats.temp = getYAMLNode(node, "stats_temp").IsNull() ? NAN_FLOAT : node["stats_temp"].as<float>();
 		stats.wind = getYAMLNode(node, "stats_wind").IsNull() ? NAN_FLOAT : node["stats_wind"].as<float>();
 		
+		backend.type = static_cast<BackendType>(getYAMLNode(node, "backend").as<int>());
+		backend.memBudget = getYAMLNode(node, "mem_budget").as<int>();
+		
 		ocl.device = getYAMLNode(node, "ocl_device").as<std::string>();
+		ocl.cache = strToPath(getYAMLNode(node, "ocl_cache").as<std::string>());
 	}
 	catch (YAML::Exception& e) {
 		throw(std::runtime_error(strfmt("Invalid config value at line {}", e.mark.line+1)));
@@ -45,6 +45,7 @@ typedef struct _image_param {
 
 typedef struct _bgsub_param {
 	int stackLen;
+	bool network;
 } BGSubParam;
 
 typedef struct _empty_check_param {
@@ -70,7 +71,16 @@ typedef struct _hologram_param {
 	float psz;
 	float lambda;
 	int reconStep;
+	int reconBatch;
+	int reconCache;
+	bool halfSpectrum;
+	bool fp16;
+	int reconPatch;
+	int reconCoarse;
 	double focusStep;
+	bool focusInterp;
+	bool focusTiles;
+	bool focusExact;
 	FocusMethod focusMethod;
 	FocusMethod focusMethodSmall;
 } HologramParam;
@@ -114,8 +124,19 @@ typedef struct _stats_param {
 	float wind;
 } StatsParam;
 
+typedef enum _backend_type {
+	BACKEND_OPENCL = 0,
+	BACKEND_CPU
+} BackendType;
+
+typedef struct _backend_param {
+	BackendType type;
+	int memBudget;
+} BackendParam;
+
 typedef struct _ocl_param {
 	std::string device;
+	fs::path cache;
 } OCLParam;
 
 class Config {
@@ -146,6 +167,7 @@ public:
 	ParticleParam particle;
 	DiameterCorrection diamCorr;
 	StatsParam stats;
+	BackendParam backend;
 	OCLParam ocl;
 };
 
@@ -1,5 +1,7 @@
 #include "icemet/database.hpp"
 #include "icemet/util/log.hpp"
+#include "icemet/util/mem.hpp"
+#include "icemet/util/ocl.hpp"
 #include "icemet/util/strfmt.hpp"
 #include "icemet/util/time.hpp"
 #include "analysis.hpp"
@@ -12,7 +14,9 @@
 #include "watcher.hpp"
 
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/utility.hpp>
 
+#include <algorithm>
 #include <cstdlib>
 #include <exception>
 #include <iostream>
@@ -21,6 +25,11 @@
 #include <thread>
 #include <vector>
 
+#define QUEUE_IMG_BYTES 4 // Bytes per pixel held by an image in the pipeline
+#define QUEUE_SPECTRUM_BYTES 8 // Bytes per padded pixel of the complex fp32 spectrum
+#define QUEUE_MEM_DIV 16
+#define QUEUE_MAX_MULT 4
+
 static const char* usageStr = "Usage: icemet-server [options] config.yaml\n";
 static const char* helpStr =
 "Options:\n"
@@ -30,7 +39,8 @@ static const char* helpStr =
 "  -p                Particles only.\n"
 "  -s                Stats only. Particles will be fetched from the database.\n"
 "  -Q                Quit after processing all available files.\n"
-"  -d                Enable debug messages.\n";
+"  -d                Enable debug messages.\n"
+"  --tune            Tune OpenCL work-group sizes for the configured image size and exit.\n";
 static const char* versionFmt =
 "ICEMET Server {}\n"
 "\n"
@@ -42,6 +52,53 @@ static void print(const std::string& fmt, Args... args)
 	std::cout << strfmt(fmt, args...);
 }
 
+static size_t queueSize(const Config& cfg, size_t size)
+{
+	if (cfg.hologram.reconStep > 0)
+		return size;
+	
+	// Scale the default queue size to the host memory, never beyond a few times the default
+	size_t imgBytes = (size_t)cfg.img.size.area() * QUEUE_IMG_BYTES;
+	
+	// Images checked by the recon checks also carry their spectrum and minimum image to recon
+	if (cfg.emptyCheck.reconTh > 0 || cfg.noisyCheck.reconTh > 0) {
+		size_t specBytes = QUEUE_SPECTRUM_BYTES;
+		if (cfg.hologram.halfSpectrum)
+			specBytes /= 2;
+		if (cfg.hologram.fp16 && cfg.backend.type != BACKEND_CPU)
+			specBytes /= 2;
+		size_t area = (size_t)cv::getOptimalDFTSize(cfg.img.size.width) * cv::getOptimalDFTSize(cfg.img.size.height);
+		imgBytes += area * specBytes + cfg.img.size.area();
+	}
+	
+	// The queues are in host memory, which the budget covers with the CPU backend
+	size_t mem = hostMemory();
+	if (cfg.backend.type == BACKEND_CPU && cfg.backend.memBudget > 0)
+		mem = std::min(mem, (size_t)cfg.backend.memBudget << 20);
+	size_t n = mem / QUEUE_MEM_DIV / std::max(imgBytes, (size_t)1);
+	return std::max((size_t)1, std::min(QUEUE_MAX_MULT*size, n));
+}
+
+static void tune(const Config& cfg, const Log& log)
+{
+	if (cfg.backend.type == BACKEND_CPU)
+		throw std::runtime_error("Tuning requires the OpenCL backend");
+	if (cfg.ocl.cache.empty())
+		throw std::runtime_error("Tuning requires ocl_cache");
+	
+	// Preproc and Recon reconstruct full images of the configured size
+	Measure m;
+	cv::Mat img(cfg.img.size, CV_8UC1);
+	cv::randn(img, 128, 16);
+	Hologram hologram(cfg.hologram.psz, cfg.hologram.lambda, cfg.hologram.dist);
+	hologram.setHalfSpectrum(cfg.hologram.halfSpectrum);
+	hologram.setFp16Storage(cfg.hologram.fp16);
+	hologram.setImg(img.getUMat(cv::ACCESS_READ));
+	hologram.tune((cfg.hologram.z0 + cfg.hologram.z1) / 2);
+	oclSaveTuning();
+	log.info("Work-group sizes tuned for {}x{} ({:.2f} s)", cfg.img.size.width, cfg.img.size.height, m.time());
+}
+
 static int cvErrorHandler(int status, const char* func, const char* msg, const char* fn, int line, void* data)
 {
 	(void)status;
@@ -83,6 +140,9 @@ int main(int argc, char* argv[])
 			else if (!arg.compare("-d")) {
 				args.loglevel = LOG_DEBUG;
 			}
+			else if (!arg.compare("--tune")) {
+				args.tune = true;
+			}
 			else {
 				print("Invalid option '{}'\n", arg);
 				return EXIT_FAILURE;
@@ -113,11 +173,34 @@ int main(int argc, char* argv[])
 		// Setup logging
 		Log::setLevel(args.loglevel);
 		
-		// Initialize OpenCL
-		std::string str = strfmt("OPENCV_OPENCL_DEVICE={}", cfg.ocl.device);
-		if (putenv(&str[0]) || !cv::ocl::useOpenCL())
-			throw std::runtime_error("OpenCL not available");
-		log.info("OpenCL device {}:{}", !cfg.ocl.device.empty() ? cfg.ocl.device : "DEFAULT", cv::ocl::Device::getDefault().name());
+		// Initialize backend
+		std::string str;
+		if (cfg.backend.type == BACKEND_CPU) {
+			str = "OPENCV_OPENCL_DEVICE=disabled";
+			if (putenv(&str[0]))
+				throw std::runtime_error("Couldn't disable OpenCL");
+			cv::ocl::setUseOpenCL(false);
+			log.info("CPU backend ({} threads)", cv::getNumThreads());
+		}
+		else {
+			str = strfmt("OPENCV_OPENCL_DEVICE={}", cfg.ocl.device);
+			if (putenv(&str[0]) || !cv::ocl::useOpenCL())
+				throw std::runtime_error("OpenCL not available");
+			log.info("OpenCL device {}:{}", !cfg.ocl.device.empty() ? cfg.ocl.device : "DEFAULT", cv::ocl::Device::getDefault().name());
+			
+			// Build the programs before any frames are read
+			Measure m;
+			oclSetCache(cfg.ocl.cache);
+			oclBuildPrograms();
+			std::string opts = Hologram::kernelOptions();
+			log.info("OpenCL programs built ({:.2f} s)", m.time());
+			if (!opts.empty())
+				log.info("OpenCL kernel options '{}'", opts);
+		}
+		if (args.tune) {
+			tune(cfg, log);
+			return EXIT_SUCCESS;
+		}
 		
 		// Connect to database
 		if (args.particlesOnly)
@@ -149,18 +232,20 @@ int main(int argc, char* argv[])
 		Stats stats(&ctx);
 		
 		// Launch worker threads
+		if (cfg.hologram.reconStep <= 0)
+			log.info("Queue sizes {}/{}", queueSize(cfg, 4), queueSize(cfg, 2));
 		std::vector<std::thread> threads;
 		if (args.statsOnly) {
-			reader.connect(stats, 2);
+			reader.connect(stats, queueSize(cfg, 2));
 			
 			threads.push_back(std::thread(&Reader::run, &reader));
 			threads.push_back(std::thread(&Stats::run, &stats));
 		}
 		else if (args.particlesOnly) {
-			watcher.connect(preproc, 4);
-			preproc.connect(recon, 2);
-			recon.connect(analysis, 2);
-			analysis.connect(saver, 2);
+			watcher.connect(preproc, queueSize(cfg, 4));
+			preproc.connect(recon, queueSize(cfg, 2));
+			recon.connect(analysis, queueSize(cfg, 2));
+			analysis.connect(saver, queueSize(cfg, 2));
 			
 			threads.push_back(std::thread(&Watcher::run, &watcher));
 			threads.push_back(std::thread(&Preproc::run, &preproc));
@@ -169,11 +254,11 @@ int main(int argc, char* argv[])
 			threads.push_back(std::thread(&Saver::run, &saver));
 		}
 		else {
-			watcher.connect(preproc, 4);
-			preproc.connect(recon, 2);
-			recon.connect(analysis, 2);
-			analysis.connect(saver, 2);
-			analysis.connect(stats, 2);
+			watcher.connect(preproc, queueSize(cfg, 4));
+			preproc.connect(recon, queueSize(cfg, 2));
+			recon.connect(analysis, queueSize(cfg, 2));
+			analysis.connect(saver, queueSize(cfg, 2));
+			analysis.connect(stats, queueSize(cfg, 2));
 			
 			threads.push_back(std::thread(&Watcher::run, &watcher));
 			threads.push_back(std::thread(&Preproc::run, &preproc));
@@ -5,6 +5,7 @@
 
 #include <opencv2/imgproc.hpp>
 
+#include <algorithm>
 #include <exception>
 
 Preproc::Preproc(ICEMETServerContext* ctx) :
@@ -12,14 +13,26 @@ Preproc::Preproc(ICEMETServerContext* ctx) :
 	m_skip(0)
 {
 	if (m_cfg->bgsub.stackLen > 0) {
-		m_stack = cv::makePtr<BGSubStack>(m_cfg->bgsub.stackLen);
-	}
-	if (m_cfg->img.rotation != 0.0) {
-		cv::Point2f center(m_cfg->img.size.width/2.0, m_cfg->img.size.height/2.0);
-		m_rot = cv::getRotationMatrix2D(center, m_cfg->img.rotation, 1.0);
+		m_stack = cv::makePtr<BGSubStack>(m_cfg->bgsub.stackLen, m_cfg->bgsub.network);
 	}
+	m_crop = cv::makePtr<Crop>(m_cfg->img.rect, m_cfg->img.rotation);
 	m_hologram = cv::makePtr<Hologram>(m_cfg->hologram.psz, m_cfg->hologram.lambda, m_cfg->hologram.dist);
-	m_range = ZRange(m_cfg->hologram.z0, m_cfg->hologram.z1, m_cfg->hologram.dz0*10, m_cfg->hologram.dz1*10);
+	m_hologram->setHalfSpectrum(m_cfg->hologram.halfSpectrum);
+	m_hologram->setFp16Storage(m_cfg->hologram.fp16);
+	
+	// Every 10th of the planes recon reconstructs, which end before the last plane
+	ZRange range(m_cfg->hologram.z0, m_cfg->hologram.z1, m_cfg->hologram.dz0, m_cfg->hologram.dz1);
+	m_range = range.slice(0, std::max(range.n()-1, 1)).sample(10);
+}
+
+bool Preproc::init()
+{
+	// Allocate buffers for the configured image size before the first frame
+	if (!m_stack.empty())
+		m_stack->setSize(m_cfg->img.size);
+	if (m_cfg->emptyCheck.reconTh > 0 || m_cfg->noisyCheck.reconTh > 0)
+		m_hologram->setSize(m_cfg->img.size);
+	return true;
 }
 
 bool Preproc::isEmpty(const cv::UMat& img, int th, const std::string& imgName, const std::string& checkName) const
@@ -28,17 +41,24 @@ bool Preproc::isEmpty(const cv::UMat& img, int th, const std::string& imgName, c
 		return false;
 	double minVal, maxVal;
 	minMaxLoc(img, &minVal, &maxVal);
-	int delta = maxVal - minVal;
+	return isEmpty(maxVal - minVal, th, imgName, checkName);
+}
+
+bool Preproc::isEmpty(int delta, int th, const std::string& imgName, const std::string& checkName) const
+{
+	if (th <= 0)
+		return false;
 	m_log.debug("{}: EmptyVal {}: {}", imgName, checkName, delta);
 	return delta < th;
 }
 
-void Preproc::finalize(ImgPtr img)
+void Preproc::finalize(ImgPtr img, double inputMean)
 {
-	img->bgVal = Math::median(img->preproc);
-	
 	if (m_cfg->emptyCheck.reconTh > 0 || m_cfg->noisyCheck.reconTh > 0) {
-		m_hologram->setImg(img->preproc);
+		if (inputMean >= 0.0)
+			m_hologram->setInput(inputMean);
+		else
+			m_hologram->setImg(img->preproc);
 		cv::UMat imgMin;
 		m_hologram->min(imgMin, m_range);
 		
@@ -74,34 +94,37 @@ void Preproc::finalize(ImgPtr img)
 			m_log.debug("{}: NoisyVal: {}", img->name(), ncontours);
 			if (ncontours > m_cfg->noisyCheck.reconTh) {
 				img->setStatus(FILE_STATUS_SKIP);
+				return;
 			}
 		}
+		
+		// Recon continues from our spectrum and minimum
+		m_hologram->takeSpectrum(img->spectrum);
+		img->coarseMin = imgMin;
 	}
 }
 
-void Preproc::processNoBgsub(ImgPtr img)
+void Preproc::processPreproc(ImgPtr img, double inputMean)
 {
+	// Background value and the empty check from one histogram
+	int minVal, maxVal;
+	img->bgVal = Math::median(img->preproc, &minVal, &maxVal);
+	
 	// Check empty
-	if (isEmpty(img->preproc, m_cfg->emptyCheck.preprocTh, img->name(), "preproc")) {
+	if (isEmpty(maxVal - minVal, m_cfg->emptyCheck.preprocTh, img->name(), "preproc")) {
 		img->setStatus(FILE_STATUS_EMPTY);
 	}
 	else {
-		finalize(img);
+		finalize(img, inputMean);
 	}
 }
 
 bool Preproc::processBgsub(ImgPtr img, ImgPtr& imgDone)
 {
-	if (m_stack->push(img)) {
+	// Crop and rotate straight to the stack
+	if (m_stack->push(img, img->original, *m_crop)) {
 		imgDone = m_stack->meddiv();
-		
-		// Check empty
-		if (isEmpty(imgDone->preproc, m_cfg->emptyCheck.preprocTh, imgDone->name(), "preproc")) {
-			imgDone->setStatus(FILE_STATUS_EMPTY);
-		}
-		else {
-			finalize(imgDone);
-		}
+		processPreproc(imgDone);
 		return true;
 	}
 	else if (m_skip < m_stack->len() / 2) {
@@ -129,16 +152,18 @@ bool Preproc::process(ImgPtr img, ImgPtr& imgDone)
 		return true;
 	}
 	
-	// Crop and rotate
-	cv::UMat tmp;
-	cv::UMat(img->original, m_cfg->img.rect).copyTo(tmp);
-	if (!m_rot.empty())
-		cv::warpAffine(tmp, img->preproc, m_rot, tmp.size());
-	else
-		img->preproc = tmp;
-	
 	if (m_stack.empty()) {
-		processNoBgsub(img);
+		// Crop and rotate, also straight to the FFT input of the recon checks
+		img->preproc = cv::UMat();
+		if (m_cfg->emptyCheck.reconTh > 0 || m_cfg->noisyCheck.reconTh > 0) {
+			m_hologram->setSize(m_crop->size());
+			cv::UMat input = m_hologram->input();
+			processPreproc(img, m_crop->apply(img->original, img->preproc, &input));
+		}
+		else {
+			m_crop->apply(img->original, img->preproc);
+			processPreproc(img);
+		}
 		imgDone = img;
 		return true;
 	}
@@ -164,6 +189,8 @@ bool Preproc::loop()
 				Measure m;
 				ImgPtr imgDone;
 				bool ret = process(img, imgDone);
+				if (ret)
+					sync();
 				m_log.debug("{}: Done ({:.2f} s)", img->name(), m.time());
 				if (ret)
 					m_outputs[0]->push(imgDone);
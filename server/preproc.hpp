@@ -11,17 +11,20 @@
 
 class Preproc : public Worker {
 protected:
-	cv::Mat m_rot;
+	CropPtr m_crop;
 	BGSubStackPtr m_stack;
 	size_t m_skip;
 	HologramPtr m_hologram;
 	ZRange m_range;
 	
 	bool isEmpty(const cv::UMat& img, int th, const std::string& imgName, const std::string& checkName) const;
-	void finalize(ImgPtr img);
+	bool isEmpty(int delta, int th, const std::string& imgName, const std::string& checkName) const;
+	// inputMean >= 0 means the image was already written to the hologram input with that mean
+	void finalize(ImgPtr img, double inputMean=-1.0);
+	void processPreproc(ImgPtr img, double inputMean=-1.0);
 	bool processBgsub(ImgPtr img, ImgPtr& imgDone);
-	void processNoBgsub(ImgPtr img);
 	bool process(ImgPtr img,ImgPtr& imgDone );
+	bool init() override;
 	bool loop() override;
 
 public:
@@ -3,29 +3,194 @@
 #include "icemet/util/time.hpp"
 
 #include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
 
 #include <algorithm>
+#include <cmath>
 #include <queue>
 
+#define SPEED_FRAMES 100
+#define PATCH_ALIGN 32
+#define PATCH_PAD 64 // Patch padding for the exact propagation without recon_patch
+#define PATCH_CACHE 8 // Patch holograms kept, the least recently used is dropped
+
 Recon::Recon(ICEMETServerContext* ctx) :
-	Worker(COLOR_GREEN "RECON" COLOR_RESET, ctx)
+	Worker(COLOR_GREEN "RECON" COLOR_RESET, ctx),
+	m_patchClock(0),
+	m_frames(0),
+	m_time(0.0)
 {
 	m_hologram = cv::makePtr<Hologram>(m_cfg->hologram.psz, m_cfg->hologram.lambda, m_cfg->hologram.dist);
+	m_hologram->setMemory((size_t)m_cfg->backend.memBudget << 20);
+	m_hologram->setStep(m_cfg->hologram.reconStep);
+	m_hologram->setBatch(m_cfg->hologram.reconBatch);
+	m_hologram->setHalfSpectrum(m_cfg->hologram.halfSpectrum);
+	m_hologram->setFp16Storage(m_cfg->hologram.fp16);
+	if (m_cfg->lpf.f)
+		m_hologram->addFilter(m_cfg->lpf.f, FILTER_LOWPASS);
 	m_range = ZRange(m_cfg->hologram.z0, m_cfg->hologram.z1, m_cfg->hologram.dz0, m_cfg->hologram.dz1);
 }
 
-void Recon::process(ImgPtr img)
+bool Recon::init()
 {
+	// Allocate buffers and fill the transfer function cache in our own thread
+	m_hologram->setCache(m_range, (size_t)m_cfg->hologram.reconCache << 20);
+	m_hologram->setSize(m_cfg->img.size);
+	if (m_cfg->hologram.reconCache > 0)
+		m_log.info("Transfer function cache {}/{} planes ({:.1f} MB)", m_hologram->cached(), m_range.n(), m_hologram->cacheSize() / 1048576.0);
+	if (m_cfg->hologram.reconStep <= 0)
+		m_log.info("Reconstruction step {}, batch size {} ({} MB budget)", m_hologram->step(), m_hologram->batch(), m_hologram->memory() >> 20);
+	
+	// Plane stack of one step as views into one buffer, reconMin() keeps using it
 	const cv::Size2i size = m_cfg->img.size;
+	const int n = std::min(m_hologram->step(), m_range.n());
+	if ((size_t)n * size.area() <= Hologram::maxStackSize()) {
+		cv::UMat buf(n*size.height, size.width, CV_8UC1);
+		for (int i = 0; i < n; i++)
+			m_stack.push_back(buf.rowRange(i*size.height, (i+1)*size.height));
+	}
+	return true;
+}
+
+static int patchLength(int len, int max)
+{
+	// Sides are rounded up to 2^k or 3*2^k, so only a few patch sizes are ever used
+	int n = PATCH_ALIGN;
+	while (n < len)
+		n = n % 3 == 0 ? n/3*4 : n/2*3;
+	return std::min(n, max);
+}
+
+Patch& Recon::patch(const cv::Size2i& size)
+{
+	auto key = std::make_pair(size.width, size.height);
+	auto it = m_patches.find(key);
+	if (it == m_patches.end()) {
+		if (m_patches.size() >= PATCH_CACHE) {
+			auto lru = std::min_element(m_patches.begin(), m_patches.end(), [](const auto& a, const auto& b) {
+				return a.second.used < b.second.used;
+			});
+			m_patches.erase(lru);
+		}
+		
+		Patch& p = m_patches[key];
+		p.hologram = cv::makePtr<Hologram>(m_cfg->hologram.psz, m_cfg->hologram.lambda, m_cfg->hologram.dist);
+		p.hologram->setHalfSpectrum(m_cfg->hologram.halfSpectrum);
+		p.hologram->setFp16Storage(m_cfg->hologram.fp16);
+		if (m_cfg->lpf.f)
+			p.hologram->addFilter(m_cfg->lpf.f, FILTER_LOWPASS);
+		p.hologram->setSize(size);
+		it = m_patches.find(key);
+	}
+	it->second.used = ++m_patchClock;
+	return it->second;
+}
+
+Patch& Recon::setPatch(const ImgPtr& img, const cv::Rect& rect, cv::Rect& rectLocal)
+{
+	// Patch around the segment, rounded to limit the number of different sizes
+	const cv::Size2i size = img->preproc.size();
+	const int pad = m_cfg->hologram.reconPatch > 0 ? m_cfg->hologram.reconPatch : PATCH_PAD;
+	cv::Size2i patchSize(
+		patchLength(rect.width + 2*pad, size.width),
+		patchLength(rect.height + 2*pad, size.height)
+	);
+	cv::Rect2i patchRect(
+		std::min(std::max(rect.x + rect.width/2 - patchSize.width/2, 0), size.width - patchSize.width),
+		std::min(std::max(rect.y + rect.height/2 - patchSize.height/2, 0), size.height - patchSize.height),
+		patchSize.width, patchSize.height
+	);
+	rectLocal = cv::Rect2i(rect.tl() - patchRect.tl(), rect.size());
+	
+	Patch& p = patch(patchSize);
+	p.hologram->setImg(cv::UMat(img->preproc, patchRect));
+	return p;
+}
+
+float Recon::focusPatch(const ImgPtr& img, const ZRange& range, const cv::Rect& rect, FocusMethod method, int& idx, double& score, cv::Mat& dst)
+{
+	// Propagate the patch and reconstruct only the planes the focus search visits
+	cv::Rect2i rectLocal;
+	Patch& p = setPatch(img, rect, rectLocal);
+	std::vector<cv::UMat> planes;
+	double frac = 0.0;
+	float z = p.hologram->focus(range, planes, rectLocal, idx, score, method, m_cfg->hologram.focusStep, m_cfg->hologram.focusInterp ? &frac : NULL);
+	if (m_cfg->hologram.focusExact && frac != 0.0) {
+		cv::UMat plane;
+		p.hologram->recon(plane, z);
+		cv::UMat(plane, rectLocal).convertTo(dst, CV_8UC1);
+	}
+	else {
+		cv::UMat(planes[idx], rectLocal).convertTo(dst, CV_8UC1);
+	}
+	return z;
+}
+
+void Recon::reconPatch(const ImgPtr& img, const cv::Rect& rect, float z, cv::Mat& dst)
+{
+	cv::Rect2i rectLocal;
+	Patch& p = setPatch(img, rect, rectLocal);
+	cv::UMat plane;
+	p.hologram->recon(plane, z);
+	cv::UMat(plane, rectLocal).convertTo(dst, CV_8UC1);
+}
+
+void Recon::coarse(const ImgPtr& img, const cv::Rect& crop, int th, std::vector<std::pair<int,int>>& intervals)
+{
+	const int n = m_range.n();
+	const int k = m_cfg->hologram.reconCoarse;
+	const int count = std::max(1, m_cfg->segment.sizeMin);
+	const int span = std::min(n-1, (int)std::ceil(2*m_cfg->hologram.focusStep) + 1);
+	
+	// Reconstruct every kth plane in steps, reusing the plane stack, and count the pixels below the threshold
+	ZRange range = m_range.sample(k);
+	const int stepSize = m_hologram->step();
+	std::vector<int> occupied(range.n());
+	cv::UMat imgMin;
+	cv::UMat imgTh;
+	for (int c0 = 0; c0 < range.n(); c0 += stepSize) {
+		int c1 = std::min(c0 + stepSize, range.n());
+		m_hologram->reconMin(m_stack, imgMin, range.slice(c0, c1), m_cfg->segment.thMethod);
+		for (int c = c0; c < c1; c++) {
+			cv::threshold(cv::UMat(m_stack[c-c0], crop), imgTh, th, 255, cv::THRESH_BINARY_INV);
+			occupied[c] = cv::countNonZero(imgTh);
+		}
+	}
+	cv::min(imgMin, img->min, img->min);
+	
+	// Fine planes between the neighbours of each occupied coarse plane
+	for (int c = 0; c < range.n(); c++) {
+		if (occupied[c] < count)
+			continue;
+		int i0 = std::max((c-1) * k, 0);
+		int i1 = std::min((c+1) * k, n-1);
+		
+		// Long enough for the step search of the focus, also at the ends of the range
+		if (i1 - i0 < span) {
+			i0 = std::max(0, std::min(i0 - (span - (i1-i0))/2, n-1 - span));
+			i1 = i0 + span;
+		}
+		if (!intervals.empty() && intervals.back().second >= i0)
+			intervals.back().second = std::max(intervals.back().second, i1);
+		else
+			intervals.emplace_back(i0, i1);
+	}
+}
+
+void Recon::process(ImgPtr img)
+{
+	const cv::Size2i size = img->preproc.size();
 	const cv::Size2i border = m_cfg->img.border;
 	const cv::Rect2i crop(
 		border.width, border.height,
 		size.width-2*border.width, size.height-2*border.height
 	);
 	
-	const int reconStep = m_cfg->hologram.reconStep;
+	// Patch refocusing needs no plane stack, so the whole range is swept at once
+	const bool patches = m_cfg->hologram.reconPatch > 0;
+	int reconStep = m_range.n();
 	const double focusStep = m_cfg->hologram.focusStep;
 	const FocusMethod focusMethod = m_cfg->hologram.focusMethod;
 	const FocusMethod focusMethodSmall = m_cfg->hologram.focusMethodSmall;
@@ -40,25 +205,63 @@ void Recon::process(ImgPtr img)
 	int ncontours = 0;
 	int nsegments = 0;
 	
-	// Set our image and apply filters
-	m_hologram->setImg(img->preproc);
-	if (m_cfg->lpf.f) {
-		if (m_lpf.empty())
-			m_lpf = m_hologram->createLPF(m_cfg->lpf.f);
-		m_hologram->applyFilter(m_lpf);
+	// Buffers sized for the previous image are no longer valid
+	if (!m_hologram->size().empty() && m_hologram->size() != size) {
+		m_log.info("Image size {}x{}", size.width, size.height);
+		m_stack.clear();
+	}
+	
+	// Set our image, the filters are part of the propagator
+	int batch = m_hologram->batch();
+	int stepSize = m_hologram->step();
+	if (!img->spectrum.empty())
+		m_hologram->setSpectrum(img->spectrum, size);
+	else
+		m_hologram->setImg(img->preproc);
+	img->spectrum.release();
+	if (m_hologram->batch() != batch)
+		m_log.info("Reconstruction batch size {}", m_hologram->batch());
+	if (m_hologram->step() != stepSize)
+		m_log.info("Reconstruction step {}", m_hologram->step());
+	if (!patches)
+		reconStep = m_hologram->step();
+	
+	// Preproc's planes are a subset of ours when the outputs match
+	if (!img->coarseMin.empty() && thMethod == RECON_OUTPUT_AMPLITUDE && !m_cfg->lpf.f)
+		img->min = img->coarseMin;
+	else
+		img->min = cv::UMat(size, CV_8UC1, cv::Scalar(255));
+	img->coarseMin.release();
+	
+	// Find the occupied parts of m_range
+	std::vector<std::pair<int,int>> intervals;
+	if (m_cfg->hologram.reconCoarse > 1) {
+		coarse(img, crop, th, intervals);
+		int nfine = 0;
+		for (const auto& interval : intervals)
+			nfine += interval.second - interval.first;
+		m_log.debug("{}: Skipped planes: {}/{}", img->name(), m_range.n()-1-nfine, m_range.n()-1);
+	}
+	else {
+		intervals.emplace_back(0, m_range.n()-1);
 	}
 	
-	// Reconstruct whole m_range in steps
-	img->min = cv::UMat(size, CV_8UC1, cv::Scalar(255));
-	const int nsteps = m_range.n() / reconStep + 1;
-	for (int step = 0; step < nsteps; step++) {
-		int i0 = step * reconStep;
-		int i1 = std::min((step+1) * reconStep, m_range.n()-1);
-		ZRange stepRange(m_range.z(i0), m_range.z(i1), m_range.dz(i0), m_range.dz(i1));
+	// Reconstruct the intervals in steps
+	std::vector<std::pair<int,int>> steps;
+	for (const auto& interval : intervals) {
+		for (int i0 = interval.first; i0 < interval.second; i0 += reconStep)
+			steps.emplace_back(i0, std::min(i0 + reconStep, interval.second));
+	}
+	for (int step = 0; step < (int)steps.size(); step++) {
+		ZRange stepRange = m_range.slice(steps[step].first, steps[step].second);
 		
 		// Reconstruct
 		cv::UMat imgMin;
-		m_hologram->reconMin(m_stack, imgMin, stepRange, thMethod);
+		cv::UMat tiles;
+		if (patches)
+			m_hologram->min(imgMin, stepRange, thMethod);
+		else
+			m_hologram->reconMin(m_stack, imgMin, stepRange, thMethod, m_cfg->hologram.focusTiles ? &tiles : NULL);
 		cv::min(imgMin, img->min, img->min);
 		
 		// Threshold
@@ -74,8 +277,9 @@ void Recon::process(ImgPtr img)
 			cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE
 		);
 		
-		// Create rects from contours
+		// Create segments from contours
 		ncontours += contours.size();
+		std::vector<SegmentPtr> segments;
 		for (const auto& cnt : contours) {
 			cv::Rect2i rectOrig = cv::boundingRect(cnt);
 			
@@ -97,22 +301,46 @@ void Recon::process(ImgPtr img)
 			rectPad.width = std::min(rectOrig.width+2*pad, size.width-rectPad.x);
 			rectPad.height = std::min(rectOrig.height+2*pad, size.height-rectPad.y);
 			
-			// Focus
-			int idx = 0;
-			double score = 0.0;
-			Hologram::focus(m_stack, rectPad, idx, score, method, 0, stepRange.n()-1, focusStep);
-			
-			// Create segment
 			SegmentPtr segm = cv::makePtr<Segment>();
-			segm->z = stepRange.z(idx);
 			segm->step = step;
-			segm->score = score;
 			segm->method = method;
 			segm->rectOrig = rectOrig;
 			segm->rectPad = rectPad;
-			cv::UMat(m_stack[idx], rectPad).copyTo(segm->img);
-			img->segments.push_back(segm);
+			segments.push_back(segm);
+		}
+		
+		// Focus
+		if (patches) {
+			for (auto& segm : segments) {
+				int idx = 0;
+				segm->z = focusPatch(img, stepRange, segm->rectPad, segm->method, idx, segm->score, segm->img);
+			}
 		}
+		else if (!segments.empty()) {
+			// All segments of the step are searched together
+			std::vector<cv::Rect> rects;
+			std::vector<FocusMethod> methods;
+			for (const auto& segm : segments) {
+				rects.push_back(segm->rectPad);
+				methods.push_back(segm->method);
+			}
+			std::vector<int> idx;
+			std::vector<double> scores;
+			std::vector<double> frac;
+			if (m_cfg->hologram.focusTiles)
+				Hologram::focusTiles(tiles.getMat(cv::ACCESS_READ), size, rects, idx, scores, m_cfg->hologram.focusInterp ? &frac : NULL);
+			else
+				Hologram::focus(m_stack, rects, methods, idx, scores, 0, stepRange.n()-1, focusStep, m_cfg->hologram.focusInterp ? &frac : NULL);
+			for (size_t k = 0; k < segments.size(); k++) {
+				segments[k]->z = frac.empty() ? stepRange.z(idx[k]) : stepRange.interp(idx[k] + frac[k]);
+				segments[k]->score = scores[k];
+				if (m_cfg->hologram.focusExact && !frac.empty() && frac[k] != 0.0)
+					reconPatch(img, rects[k], segments[k]->z, segments[k]->img);
+				else
+					cv::UMat(m_stack[idx[k]], rects[k]).copyTo(segments[k]->img);
+			}
+		}
+		img->segments.insert(img->segments.end(), segments.begin(), segments.end());
 	}
 	
 	if ((nsegments = img->segments.size()) == 0)
@@ -120,6 +348,12 @@ void Recon::process(ImgPtr img)
 	m_log.debug("{}: Segments: {}, Contours: {}", img->name(), nsegments, ncontours);
 }
 
+void Recon::logSpeed() const
+{
+	if (m_frames > 0)
+		m_log.info("Reconstructed {} frames ({:.2f} frames/s, {})", m_frames, m_frames / m_time, cv::ocl::useOpenCL() ? "OpenCL" : "CPU");
+}
+
 bool Recon::loop()
 {
 	std::queue<WorkerData> queue;
@@ -138,7 +372,12 @@ bool Recon::loop()
 					Measure m;
 					m_log.debug("{}: Reconstructing", img->name());
 					process(img);
-					m_log.debug("{}: Done ({:.2f} s)", img->name(), m.time());
+					sync();
+					double t = m.time();
+					m_log.debug("{}: Done ({:.2f} s)", img->name(), t);
+					m_time += t;
+					if (++m_frames % SPEED_FRAMES == 0)
+						logSpeed();
 				}
 				break;
 			}
@@ -153,3 +392,8 @@ bool Recon::loop()
 	}
 	return !quit;
 }
+
+void Recon::close()
+{
+	logSpeed();
+}
@@ -5,17 +5,35 @@
 #include "icemet/hologram.hpp"
 #include "server/worker.hpp"
 
+#include <map>
+#include <utility>
 #include <vector>
 
+typedef struct _patch {
+	HologramPtr hologram;
+	unsigned int used;
+} Patch;
+
 class Recon : public Worker {
 protected:
 	HologramPtr m_hologram;
 	ZRange m_range;
 	std::vector<cv::UMat> m_stack;
-	cv::UMat m_lpf;
+	std::map<std::pair<int,int>,Patch> m_patches;
+	unsigned int m_patchClock;
+	unsigned int m_frames;
+	double m_time;
 	
+	Patch& patch(const cv::Size2i& size);
+	Patch& setPatch(const ImgPtr& img, const cv::Rect& rect, cv::Rect& rectLocal);
+	float focusPatch(const ImgPtr& img, const ZRange& range, const cv::Rect& rect, FocusMethod method, int& idx, double& score, cv::Mat& dst);
+	void reconPatch(const ImgPtr& img, const cv::Rect& rect, float z, cv::Mat& dst);
+	void coarse(const ImgPtr& img, const cv::Rect& crop, int th, std::vector<std::pair<int,int>>& intervals);
 	void process(ImgPtr img);
+	void logSpeed() const;
+	bool init() override;
 	bool loop() override;
+	void close() override;
 
 public:
 	Recon(ICEMETServerContext* ctx);
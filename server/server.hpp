@@ -14,9 +14,10 @@ typedef struct _arguments {
 	bool testConfig;
 	bool statsOnly;
 	bool particlesOnly;
+	bool tune;
 	LogLevel loglevel;
 	
-	_arguments() : cfgFile(fs::path()), root(fs::path(".")), waitNew(true), testConfig(false), statsOnly(false), particlesOnly(false), loglevel(LOG_INFO) {}
+	_arguments() : cfgFile(fs::path()), root(fs::path(".")), waitNew(true), testConfig(false), statsOnly(false), particlesOnly(false), tune(false), loglevel(LOG_INFO) {}
 } Arguments;
 
 typedef struct _icemet_server_context {
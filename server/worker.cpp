@@ -1,5 +1,7 @@
 #include "worker.hpp"
 
+#include <opencv2/core/ocl.hpp>
+
 #include <algorithm>
 #include <cstdlib>
 #include <exception>
@@ -53,6 +55,14 @@ Worker::Worker(const std::string& name, ICEMETServerContext* ctx) :
 	m_cfg(ctx->cfg),
 	m_db(ctx->db) {}
 
+void Worker::sync() const
+{
+	// Kernels are launched asynchronously and every thread has its own queue,
+	// so the results must be complete before they are handed to the next worker
+	if (cv::ocl::useOpenCL())
+		cv::ocl::finish();
+}
+
 void Worker::run()
 {
 	m_log.debug("Running");
@@ -85,6 +85,8 @@ protected:
 	std::vector<WorkerQueuePtr> m_inputs;
 	std::vector<WorkerQueuePtr> m_outputs;
 	
+	void sync() const;
+	
 	virtual bool init() { return true; }
 	virtual bool loop() { return false; }
 	virtual void close() {}